@@ -0,0 +1,186 @@
+import subprocess
+import os
+import sys
+import time
+import json
+import socket
+import random
+import hashlib
+import threading
+import itertools
+
+
+# Default sweep (override with --windows, --timeouts, --payloads, --sizes)
+WINDOWS = [1, 16, 64]
+TIMEOUTS = [100, 1000]
+PAYLOADS = [500, 8192]
+SIZES = [64 * 1024, 1024 * 1024]
+
+# Per-run wall clock limit in seconds
+RUN_LIMIT = 60
+
+
+def free_port():
+    s = socket.socket(socket.AF_INET, socket.SOCK_DGRAM)
+    s.bind(('127.0.0.1', 0))
+    port = s.getsockname()[1]
+    s.close()
+    return port
+
+
+def make_data(size, seed):
+    # Known, incompressible data so that the output can be verified
+    rng = random.Random(seed)
+    return rng.getrandbits(8 * size).to_bytes(size, 'little') if size > 0 else b''
+
+
+def runnable(binary):
+    # The shipped reference binary needs libgmp.so.3, which is not available
+    # everywhere; probe it instead of failing half-way through a sweep.
+    if not os.access(binary, os.X_OK):
+        return False
+    try:
+        p = subprocess.run([binary], stdout=subprocess.DEVNULL, stderr=subprocess.PIPE, timeout=5)
+    except (OSError, subprocess.TimeoutExpired):
+        return False
+    return b'error while loading shared libraries' not in p.stderr
+
+
+def feed(pipe, data, payload):
+    try:
+        for i in range(0, len(data), payload):
+            pipe.write(data[i:i + payload])
+            pipe.flush()
+    except BrokenPipeError:
+        pass
+    finally:
+        try:
+            pipe.close()
+        except BrokenPipeError:
+            pass
+
+
+def wait_rusage(proc, deadline):
+    # os.wait4 gives us per-process CPU time; poll so that we can enforce the limit.
+    while True:
+        pid, status, ru = os.wait4(proc.pid, os.WNOHANG)
+        if pid == proc.pid:
+            proc.returncode = os.waitstatus_to_exitcode(status)
+            return ru.ru_utime + ru.ru_stime, time.monotonic()
+        if time.monotonic() > deadline:
+            proc.kill()
+            pid, status, ru = os.wait4(proc.pid, 0)
+            proc.returncode = None
+            return ru.ru_utime + ru.ru_stime, None
+        time.sleep(0.001)
+
+
+def run_one(binary, window, timeout, payload, size, seed):
+    data = make_data(size, seed)
+    rport, sport = free_port(), free_port()
+    args = ['-w', str(window), '-t', str(timeout)]
+
+    out_path = 'bench_recv.tmp'
+    out_file = open(out_path, 'wb')
+    receiver = subprocess.Popen([binary] + args + [str(rport), 'localhost:%d' % sport],
+                                stdin=subprocess.PIPE, stdout=out_file, stderr=subprocess.DEVNULL)
+    time.sleep(0.1)
+
+    start = time.monotonic()
+    sender = subprocess.Popen([binary] + args + [str(sport), 'localhost:%d' % rport],
+                              stdin=subprocess.PIPE, stdout=subprocess.DEVNULL, stderr=subprocess.PIPE)
+    feeder = threading.Thread(target=feed, args=(sender.stdin, data, payload))
+    feeder.start()
+
+    # The receiver has nothing to send back, but its EOF must not reach the
+    # sender before the sender's socket is bound ("[listening on ...]").
+    sender.stderr.readline()
+    receiver.stdin.close()
+    threading.Thread(target=sender.stderr.read, daemon=True).start()
+
+    deadline = start + RUN_LIMIT
+    send_cpu, send_end = wait_rusage(sender, deadline)
+    recv_cpu, recv_end = wait_rusage(receiver, deadline)
+    feeder.join()
+    out_file.close()
+
+    with open(out_path, 'rb') as f:
+        received = f.read()
+    os.remove(out_path)
+
+    ok = send_end is not None and recv_end is not None and received == data
+    elapsed = (recv_end - start) if recv_end is not None else None
+    return {
+        'binary': os.path.basename(binary),
+        'window': window,
+        'timeout_ms': timeout,
+        'payload': payload,
+        'bytes': size,
+        'status': 'ok' if ok else ('timeout' if elapsed is None else 'mismatch'),
+        'latency_s': round(elapsed, 6) if elapsed is not None else None,
+        'throughput_Bps': round(size / elapsed, 1) if ok and elapsed > 0 else None,
+        'sender_cpu_s': round(send_cpu, 6),
+        'receiver_cpu_s': round(recv_cpu, 6),
+        'sha1': hashlib.sha1(data).hexdigest(),
+    }
+
+
+def parse_list(value):
+    return [int(x) for x in value.split(',') if x]
+
+
+def main(argv):
+    global RUN_LIMIT
+    binaries = ['./reliable', './reference']
+    output = 'bench_output.txt'
+    sweep = {'windows': WINDOWS, 'timeouts': TIMEOUTS, 'payloads': PAYLOADS, 'sizes': SIZES}
+
+    i = 0
+    while i < len(argv):
+        opt = argv[i].lstrip('-')
+        if opt in sweep and i + 1 < len(argv):
+            sweep[opt] = parse_list(argv[i + 1])
+        elif opt == 'binaries' and i + 1 < len(argv):
+            binaries = [b for b in argv[i + 1].split(',') if b]
+        elif opt == 'output' and i + 1 < len(argv):
+            output = argv[i + 1]
+        elif opt == 'limit' and i + 1 < len(argv):
+            RUN_LIMIT = float(argv[i + 1])
+        else:
+            print("Usage: python bench.py [--windows 1,16] [--timeouts 100] [--payloads 500]"
+                  " [--sizes 65536] [--binaries ./reliable,./reference] [--limit secs] [--output file]")
+            exit(1)
+        i += 2
+
+    results = []
+    with open(output, 'w') as out:
+        for binary in binaries:
+            if not runnable(binary):
+                # Only the reference binary may be missing its libraries; a
+                # broken build of our own must not pass as a sweep of 0 runs.
+                if os.path.basename(binary) != 'reference':
+                    print("%s: not runnable" % binary)
+                    exit(1)
+                print("%s: not runnable here, skipped" % binary)
+                rec = {'binary': os.path.basename(binary), 'status': 'skipped'}
+                out.write(json.dumps(rec) + '\n')
+                continue
+            for seed, (w, t, p, s) in enumerate(itertools.product(
+                    sweep['windows'], sweep['timeouts'], sweep['payloads'], sweep['sizes'])):
+                rec = run_one(binary, w, t, p, s, seed)
+                results.append(rec)
+                out.write(json.dumps(rec) + '\n')
+                out.flush()
+                print("%-10s w=%-4d t=%-5d payload=%-6d bytes=%-9d %-8s %10s B/s  %8s s  cpu %.3f/%.3f s"
+                      % (rec['binary'], w, t, p, s, rec['status'],
+                         rec['throughput_Bps'], rec['latency_s'],
+                         rec['sender_cpu_s'], rec['receiver_cpu_s']))
+
+    failed = [r for r in results if r['status'] != 'ok']
+    print("%d runs, %d failed; results written to %s" % (len(results), len(failed), output))
+    if failed:
+        exit(1)
+
+
+if __name__ == "__main__":
+    main(sys.argv[1:])
@@ -37,10 +37,47 @@ int buffer_remove_first(buffer_t *buffer) {
  * @param   last_retransmit     Last retransmission time (long)
 */
 void buffer_insert(buffer_t *buffer, packet_t *packet, long last_retransmit) {
-
-    // Node to insert
-    buffer_node_t* to_insert = xmalloc(sizeof(buffer_node_t));
+    buffer_node_t* to_insert = buffer_node_alloc();
     to_insert->packet = *packet;
+    buffer_insert_node(buffer, to_insert, last_retransmit);
+}
+
+/**
+ * Inserting only a packet's header in its place by its sequence number.
+ *
+ * @param   buffer              Pointer to buffer
+ * @param   packet              Pointer to packet (only the header is copied)
+ * @param   payload_offset      Where the payload can be found again
+ * @param   last_retransmit     Last retransmission time (long)
+*/
+void buffer_insert_header(buffer_t *buffer, packet_t *packet, size_t payload_offset, long last_retransmit) {
+    buffer_node_t* to_insert = xmalloc(offsetof(buffer_node_t, packet.data));
+    memcpy(&to_insert->packet, packet, offsetof(packet_t, data));
+    to_insert->header_only = 1;
+    to_insert->payload_offset = payload_offset;
+    buffer_insert_node(buffer, to_insert, last_retransmit);
+}
+
+/**
+ * Allocate a buffer node on the heap, with its packet left uninitialized.
+ *
+ * @return  Pointer to the new buffer node
+*/
+buffer_node_t* buffer_node_alloc(void) {
+    buffer_node_t* node = xmalloc(sizeof(buffer_node_t));
+    node->header_only = 0;
+    return node;
+}
+
+/**
+ * Inserting an already filled-in node in its place by its packet's sequence number.
+ *
+ * @param   buffer              Pointer to buffer
+ * @param   to_insert           Pointer to node (from buffer_node_alloc)
+ * @param   last_retransmit     Last retransmission time (long)
+*/
+void buffer_insert_node(buffer_t *buffer, buffer_node_t *to_insert, long last_retransmit) {
+
     to_insert->last_retransmit = last_retransmit;
 
     // When iterating, previous and current
@@ -58,7 +95,7 @@ void buffer_insert(buffer_t *buffer, packet_t *packet, long last_retransmit) {
         while (current != NULL) {
 
             // If found an element whose sequence number is higher
-            if (ntohl(current->packet.seqno) > ntohl(packet->seqno)) {
+            if (ntohl(current->packet.seqno) > ntohl(to_insert->packet.seqno)) {
 
                 // If it was the head (there is no previous)
                 if (prev == NULL) {
@@ -31,9 +31,11 @@
 */
 
 typedef struct buffer_node {
-    packet_t packet;
     long last_retransmit;
     struct buffer_node* next;
+    int header_only;            // packet.data is not allocated (see buffer_insert_header)
+    size_t payload_offset;      // if header_only: where the payload is in the mapped input
+    packet_t packet;            // last, so that header-only nodes can leave out packet.data
 } buffer_node_t;
 
 typedef struct buffer {
@@ -68,6 +70,37 @@ int buffer_remove_first(buffer_t *buffer);
 */
 void buffer_insert(buffer_t *buffer, packet_t *packet, long last_retransmit);
 
+/**
+ * Inserting only a packet's header in its place by its sequence number, for a payload
+ * that can be found again elsewhere (e.g., in a memory-mapped input file).
+ * The node is allocated without room for packet.data, which must not be accessed.
+ *
+ * @param   buffer              Pointer to buffer
+ * @param   packet              Pointer to packet (only the header is copied)
+ * @param   payload_offset      Where the payload can be found again
+ * @param   last_retransmit     Last retransmission time (long)
+*/
+void buffer_insert_header(buffer_t *buffer, packet_t *packet, size_t payload_offset, long last_retransmit);
+
+/**
+ * Allocate a buffer node on the heap, with its packet left uninitialized.
+ * It can be filled in place (e.g., received into) and then linked into a buffer
+ * with buffer_insert_node, or released again with free.
+ *
+ * @return  Pointer to the new buffer node
+*/
+buffer_node_t* buffer_node_alloc(void);
+
+/**
+ * Inserting an already filled-in node in its place by its packet's sequence number.
+ * The node is linked in as is (no copy); the buffer takes ownership of it.
+ *
+ * @param   buffer              Pointer to buffer
+ * @param   node                Pointer to node (from buffer_node_alloc)
+ * @param   last_retransmit     Last retransmission time (long)
+*/
+void buffer_insert_node(buffer_t *buffer, buffer_node_t *node, long last_retransmit);
+
 /**
  * Remove all buffer nodes until (lower-than exclusive <) a certain packet sequence number from the buffer.
  *
@@ -0,0 +1,150 @@
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <time.h>
+#include <arpa/inet.h>
+
+#include "rlib.h"
+#include "buffer.h"
+
+/*
+ * Microbenchmark for the buffer operations used by the send and receive queues.
+ *
+ * Links against buffer.o only; xmalloc is provided here so that every allocation
+ * made by buffer.c can be counted. Results are printed as one line per
+ * (operation, window size): ns/op and allocations/op.
+ *
+ * usage: buffer_bench [max-window]     (default 65536)
+*/
+
+char *progname = "buffer_bench";
+int opt_debug;
+
+static unsigned long num_allocs;
+
+void *xmalloc(size_t n) {
+    void *p = malloc(n);
+    if (!p) {
+        fprintf(stderr, "%s: out of memory allocating %d bytes\n", progname, (int) n);
+        abort();
+    }
+    num_allocs++;
+    return p;
+}
+
+static double now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static void report(const char *op, uint32_t window, double ns, unsigned long allocs, unsigned long ops) {
+    printf("%-16s %8u %12.1f %10.3f\n", op, window, ns / ops, (double) allocs / ops);
+    fflush(stdout);
+}
+
+static void fill(buffer_t *buffer, const uint32_t *seqnos, uint32_t n) {
+    packet_t pkt;
+    memset(&pkt, 0, sizeof(pkt));
+    pkt.len = htons(512);
+    for (uint32_t i = 0; i < n; i++) {
+        pkt.seqno = htonl(seqnos[i]);
+        buffer_insert(buffer, &pkt, 0);
+    }
+}
+
+/**
+ * Time inserting n packets in the given seqno order into an empty buffer.
+ *
+ * @param   op          Name of the pattern
+ * @param   seqnos      Sequence numbers in insertion order
+ * @param   n           Window size
+*/
+static void bench_insert(const char *op, const uint32_t *seqnos, uint32_t n) {
+    buffer_t buffer = { NULL };
+    unsigned long allocs = num_allocs;
+    double start = now_ns();
+    fill(&buffer, seqnos, n);
+    double ns = now_ns() - start;
+    report(op, n, ns, num_allocs - allocs, n);
+    buffer_clear(&buffer);
+}
+
+static void bench_window(uint32_t n) {
+    uint32_t *order = xmalloc(n * sizeof(uint32_t));
+    uint32_t *reverse = xmalloc(n * sizeof(uint32_t));
+    uint32_t *shuffled = xmalloc(n * sizeof(uint32_t));
+    buffer_t buffer = { NULL };
+    unsigned long allocs, ops;
+    volatile uint32_t sink = 0;
+    double start;
+
+    for (uint32_t i = 0; i < n; i++) {
+        order[i] = i + 1;
+        reverse[i] = n - i;
+        shuffled[i] = i + 1;
+    }
+    for (uint32_t i = n - 1; i > 0; i--) {
+        uint32_t j = (uint32_t) rand() % (i + 1);
+        uint32_t t = shuffled[i];
+        shuffled[i] = shuffled[j];
+        shuffled[j] = t;
+    }
+
+    bench_insert("insert-inorder", order, n);
+    bench_insert("insert-reverse", reverse, n);
+    bench_insert("insert-random", shuffled, n);
+
+    // Repeat the lookups enough times to get a stable figure for small windows,
+    // without letting O(n) lookups on large windows dominate the run
+    ops = (1UL << 20) / n < 16 ? 16 : (1UL << 20) / n;
+
+    fill(&buffer, order, n);
+    allocs = num_allocs;
+    start = now_ns();
+    for (unsigned long i = 0; i < ops; i++) {
+        sink += buffer_size(&buffer);
+    }
+    report("size", n, now_ns() - start, num_allocs - allocs, ops);
+
+    allocs = num_allocs;
+    start = now_ns();
+    for (unsigned long i = 0; i < ops; i++) {
+        sink += buffer_contains(&buffer, shuffled[i % n]);
+    }
+    report("contains", n, now_ns() - start, num_allocs - allocs, ops);
+
+    // Cumulative acks advancing one packet at a time
+    allocs = num_allocs;
+    start = now_ns();
+    for (uint32_t i = 1; i <= n; i++) {
+        sink += buffer_remove(&buffer, i + 1);
+    }
+    report("remove", n, now_ns() - start, num_allocs - allocs, n);
+
+    fill(&buffer, order, n);
+    allocs = num_allocs;
+    start = now_ns();
+    buffer_clear(&buffer);
+    report("clear", n, now_ns() - start, num_allocs - allocs, n);
+
+    (void) sink;
+    free(order);
+    free(reverse);
+    free(shuffled);
+}
+
+int main(int argc, char **argv) {
+    uint32_t max_window = argc > 1 ? (uint32_t) atoi(argv[1]) : 65536;
+    if (max_window < 1) {
+        fprintf(stderr, "usage: %s [max-window]\n", progname);
+        return 1;
+    }
+
+    srand(1);
+    printf("%-16s %8s %12s %10s\n", "op", "window", "ns/op", "allocs/op");
+    for (uint32_t n = 1; n <= max_window; n *= 4) {
+        bench_window(n);
+    }
+    return 0;
+}
@@ -0,0 +1,169 @@
+#include <string.h>
+
+#include "lz.h"
+
+#define LZ_MAX_LIT 32               // literals per run
+#define LZ_MAX_REF (2 + 7 + 255)    // length of a back reference
+
+static inline unsigned lz_hash(const uint8_t *p) {
+    uint32_t v = p[0] << 16 | p[1] << 8 | p[2];
+    return (v * 2654435761u) >> 20;     // 12 bits: LZ_HASH_SIZE
+}
+
+// Output size of n literals
+static inline size_t lz_lit_cost(size_t n) {
+    return n + (n + LZ_MAX_LIT - 1) / LZ_MAX_LIT;
+}
+
+/**
+ * Append n literal bytes, split into runs.
+ *
+ * @param   out     Output
+ * @param   op      Output position
+ * @param   lit     Literals
+ * @param   n       Number of literals
+ *
+ * @return  New output position
+*/
+static size_t lz_put_literals(uint8_t *out, size_t op, const uint8_t *lit, size_t n) {
+    while (n > 0) {
+        size_t k = n < LZ_MAX_LIT ? n : LZ_MAX_LIT;
+        out[op++] = k - 1;
+        memcpy(out + op, lit, k);
+        op += k;
+        lit += k;
+        n -= k;
+    }
+    return op;
+}
+
+/**
+ * Compress a prefix of buf[start..end) into at most outcap bytes.
+ *
+ * @param   buf         History (from lo) followed by the input (from start)
+ * @param   lo          Where the history starts
+ * @param   start       Where the input starts
+ * @param   end         Where the input ends (buffer positions must stay below 2^32)
+ * @param   out         Where to put the compressed data
+ * @param   outcap      Capacity of out
+ * @param   outlen      Set to the number of bytes put in out
+ * @param   htab        LZ_HASH_SIZE positions, kept between calls on the same buffer
+ *
+ * @return  Number of input bytes that out decompresses to
+*/
+size_t lz_compress(const uint8_t *buf, size_t lo, size_t start, size_t end,
+                   uint8_t *out, size_t outcap, size_t *outlen, uint32_t *htab) {
+    size_t ip = start, op = 0, lit = start;
+
+    while (ip + 3 <= end && op + lz_lit_cost(ip - lit) <= outcap) {
+        unsigned h = lz_hash(buf + ip);
+        size_t ref = htab[h];
+        htab[h] = ip + 1;
+
+        // Entries may be stale, from before lo or from input not used last time
+        if (ref-- > lo && ref < ip && ip - ref <= LZ_WINDOW && memcmp(buf + ref, buf + ip, 3) == 0) {
+            size_t max = end - ip < LZ_MAX_REF ? end - ip : LZ_MAX_REF;
+            size_t len = 3;
+            while (len < max && buf[ref + len] == buf[ip + len]) {
+                len++;
+            }
+
+            // Stop if the pending literals and the reference don't both fit
+            size_t off = ip - ref - 1;
+            size_t l = len - 2;
+            if (op + lz_lit_cost(ip - lit) + (l >= 7 ? 3 : 2) > outcap) {
+                break;
+            }
+            op = lz_put_literals(out, op, buf + lit, ip - lit);
+            if (l < 7) {
+                out[op++] = (l << 5) | (off >> 8);
+            } else {
+                out[op++] = (7 << 5) | (off >> 8);
+                out[op++] = l - 7;
+            }
+            out[op++] = off & 0xff;
+
+            // Remember the positions inside the reference, too
+            size_t stop = ip + len;
+            for (ip++; ip < stop && ip + 3 <= end; ip++) {
+                htab[lz_hash(buf + ip)] = ip + 1;
+            }
+            ip = stop;
+            lit = ip;
+        } else {
+            ip++;
+        }
+    }
+
+    // Whatever is left over goes out as literals, as far as they fit
+    size_t n = end - lit;
+    while (n > 0 && op + lz_lit_cost(n) > outcap) {
+        n--;
+    }
+    op = lz_put_literals(out, op, buf + lit, n);
+
+    *outlen = op;
+    return lit + n - start;
+}
+
+/**
+ * Account for the buffer given to lz_compress having been moved d bytes to the front.
+ *
+ * @param   htab        Positions, as passed to lz_compress
+ * @param   d           Distance moved
+*/
+void lz_shift(uint32_t *htab, size_t d) {
+    for (size_t i = 0; i < LZ_HASH_SIZE; i++) {
+        htab[i] = htab[i] > d ? htab[i] - d : 0;
+    }
+}
+
+/**
+ * Decompress data made by lz_compress, after the history in out.
+ *
+ * @param   in          Compressed data
+ * @param   inlen       Its length
+ * @param   out         History, followed by room for the decompressed data
+ * @param   start       Length of the history
+ * @param   outcap      Capacity of out, including the history
+ *
+ * @return  Number of bytes put in out after the history, or -1 if the data is corrupt
+ *          or does not fit
+*/
+long lz_decompress(const uint8_t *in, size_t inlen, uint8_t *out, size_t start, size_t outcap) {
+    size_t ip = 0, op = start;
+
+    while (ip < inlen) {
+        unsigned c = in[ip++];
+        if (c < 32) {
+            size_t n = c + 1;
+            if (ip + n > inlen || op + n > outcap) {
+                return -1;
+            }
+            memcpy(out + op, in + ip, n);
+            ip += n;
+            op += n;
+        } else {
+            size_t len = c >> 5;
+            if (len == 7) {
+                if (ip >= inlen) {
+                    return -1;
+                }
+                len += in[ip++];
+            }
+            len += 2;
+            if (ip >= inlen) {
+                return -1;
+            }
+            size_t off = ((c & 0x1f) << 8 | in[ip++]) + 1;
+            if (off > op || op + len > outcap) {
+                return -1;
+            }
+            // may overlap the output being produced, so byte by byte
+            for (size_t i = 0; i < len; i++, op++) {
+                out[op] = out[op - off];
+            }
+        }
+    }
+    return op - start;
+}
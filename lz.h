@@ -0,0 +1,66 @@
+#ifndef LZ_H
+#define LZ_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * A small, fast LZ77 compressor (in the style of LZF) for packet payloads.
+ *
+ * The compressed stream is a sequence of tokens, each starting with a control byte c:
+ *   c < 32     a run of c + 1 literal bytes follows
+ *   c >= 32    a back reference: length (c >> 5) + 2, where 7 means that a further byte
+ *              is added to the length, then one byte which, with the low 5 bits of c,
+ *              gives the distance back minus 1 (up to LZ_WINDOW)
+ *
+ * Back references may reach into history: data compressed (or sent raw) before, which
+ * the decompressing side has in front of its output, too. Compression stops as soon as
+ * the output would exceed its capacity, so that a packet can be filled with as much
+ * input as fits, and reports how much input it used.
+*/
+
+#define LZ_WINDOW 8192          // how far back references reach
+#define LZ_HASH_SIZE 4096       // entries of the table lz_compress remembers positions in
+
+/**
+ * Compress a prefix of buf[start..end) into at most outcap bytes.
+ *
+ * @param   buf         History (from lo) followed by the input (from start)
+ * @param   lo          Where the history starts
+ * @param   start       Where the input starts
+ * @param   end         Where the input ends (buffer positions must stay below 2^32)
+ * @param   out         Where to put the compressed data
+ * @param   outcap      Capacity of out
+ * @param   outlen      Set to the number of bytes put in out
+ * @param   htab        LZ_HASH_SIZE positions, zeroed before the first call and kept
+ *                      between calls on the same buffer (see lz_shift)
+ *
+ * @return  Number of input bytes that out decompresses to
+*/
+size_t lz_compress(const uint8_t *buf, size_t lo, size_t start, size_t end,
+                   uint8_t *out, size_t outcap, size_t *outlen, uint32_t *htab);
+
+/**
+ * Account for the buffer given to lz_compress having been moved d bytes to the front.
+ *
+ * @param   htab        Positions, as passed to lz_compress
+ * @param   d           Distance moved
+*/
+void lz_shift(uint32_t *htab, size_t d);
+
+/**
+ * Decompress data made by lz_compress, after the history in out.
+ *
+ * @param   in          Compressed data
+ * @param   inlen       Its length
+ * @param   out         History (the same as was given to lz_compress), followed by room
+ *                      for the decompressed data
+ * @param   start       Length of the history
+ * @param   outcap      Capacity of out, including the history
+ *
+ * @return  Number of bytes put in out after the history, or -1 if the data is corrupt
+ *          or does not fit
+*/
+long lz_decompress(const uint8_t *in, size_t inlen, uint8_t *out, size_t start, size_t outcap);
+
+#endif /* LZ_H */
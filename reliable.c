@@ -7,13 +7,58 @@
 #include <poll.h>
 #include <errno.h>
 #include <time.h>
-#include <sys/time.h>
 #include <sys/socket.h>
 #include <sys/uio.h>
 #include <netinet/in.h>
 
 #include "rlib.h"
 #include "buffer.h"
+#include "lz.h"
+
+/*
+ * Resumable transfers (-R). A side that was given a checkpoint file offers, in a control
+ * packet (a data packet with seqno 0), how much of the peer's stream it already delivered,
+ * along with a hash of the last bytes of it. The peer checks the hash against its input and
+ * seeks there (or starts over), and says in its own control packet where its data starts.
+ * Until both control packets have made it across, no data is sent or accepted.
+ *
+ * Sides without a checkpoint file never seek, but answer control packets, so that the
+ * other side learns it has to start over.
+*/
+
+#define CTRL_HAVE 1             // sender has the peer's control packet (from is valid)
+#define CTRL_WANT 2             // sender still needs the peer's control packet
+#define CTRL_LZ 4               // sender can take compressed packets
+
+/*
+ * Compression (-C). Once the peer's control packet says it can take them, data packets
+ * carry as much input as lz_compress fits into one packet, when that is more than a raw
+ * packet would. Such packets have LEN_LZ set in len, and their payload is the raw length
+ * (2 bytes) followed by the compressed data. Back references reach up to LZ_WINDOW bytes
+ * into the data of earlier packets, compressed or not, from the first compressed packet
+ * on; the receiver keeps that much of what it delivered. Control packets are also
+ * exchanged without a checkpoint file then, but data is not held back for them.
+*/
+
+#define LEN_LZ 0x8000           // flag in len: compressed payload
+#define LZ_MAX_RAW 4096         // input compressed into one packet, at most
+#define ZBUF_SIZE 32768         // sender: history and input not sent yet
+#define UNZ_SIZE 65536          // receiver: room for one rel_output batch, after the history
+
+#define EOF_RESENDS 4           // resends of our EOF, once nothing else is left, before giving up
+
+#define PKT_DATA sizeof(((packet_t*) 0)->data)   // payload of a full data packet
+
+#define CKPT_TAIL 4096          // bytes before the checkpoint offset covered by its hash
+#define CKPT_INTERVAL 1000      // ms between checkpoint file updates
+
+typedef struct ctrl {
+    uint32_t offset[2];         // bytes of the receiver's stream delivered so far (high, low)
+    uint32_t hash[2];           // FNV-1a of the hashlen bytes before offset
+    uint32_t hashlen;
+    uint32_t from[2];           // offset in its input the sender's own data starts at
+    uint32_t flags;
+} ctrl_t;
 
 struct reliable_state {
     rel_t *next;			/* Linked list for traversing all connections */
@@ -27,6 +72,7 @@ struct reliable_state {
     int send_max_window_size;
     int send_next_not_alloc;
     int send_eof;
+    int eof_resends;            // times our EOF came due with nothing else left to do
 
     int rec_sliding_window_start;
     int rec_window_size;
@@ -36,11 +82,65 @@ struct reliable_state {
 
     long timeout;
 
+    // round-trip time (RFC 6298 smoothing), timing one packet at a time and none that
+    // was retransmitted (Karn)
+    long srtt;                  // smoothed, in microseconds (0 until the first sample)
+    long rttvar;                // mean deviation, in microseconds
+    uint32_t rtt_seqno;         // packet being timed, 0 if none
+    long rtt_sent;              // when it was sent
+
+    // tail loss probe: no ack for two round trips, resend the last packet in flight
+    long tlp_at;                // when, 0 if not armed
+    int tlp_sent;               // sent, and no ack has made progress since
+
+    // advertised windows (-W, 10-byte ACKs)
+    int advertise;              // put our receive window in our ACKs
+    int rec_adv_wnd;            // the window we last advertised
+    int peer_wnd;               // the peer advertises its window
+    uint32_t send_wnd_ackno;    // ackno its last window came with
+    uint32_t send_wnd_edge;     // and the first seqno outside it
+
     buffer_t* send_buffer;
     buffer_t* rec_buffer;
 
+    // nodes handed out for datagrams to be received into (see rel_rxslot)
+    buffer_node_t* rxslots[RECV_BATCH];
+
+    // resumable transfers (-R)
+    const char* checkpoint;     // checkpoint file, NULL if not resuming
+    int ctrl_pending;           // control packets not exchanged yet: hold data back
+    int ctrl_got_peer;          // we have the peer's control packet
+    int ctrl_peer_has_ours;     // the peer has ours
+    long ctrl_last_sent;        // when ours was last sent (0 if never)
+    uint64_t resume_offset;     // offered to the peer, from the checkpoint file
+    uint64_t resume_hash;
+    uint32_t resume_hashlen;
+    uint64_t send_from;         // offset in our input our data starts at
+    uint64_t rec_offset;        // offset in the output of the next byte delivered
+    uint64_t rec_run_start;     // rec_offset when this run began delivering
+    char rec_tail[CKPT_TAIL];   // last bytes delivered, at rec_offset % CKPT_TAIL
+    uint64_t ckpt_offset;       // rec_offset last recorded in the checkpoint file
+    long ckpt_last;             // when it was recorded
+
+    // compression (-C)
+    int compress;               // compress our data, once the peer can take it
+    int peer_lz;                // the peer can take compressed packets
+    uint8_t* zbuf;              // input sent (history) and not sent yet (ZBUF_SIZE bytes)
+    size_t zpos;                // first byte not sent
+    size_t zend;                // end of the input read
+    size_t zlo;                 // start of the history, once zon
+    int zon;                    // a compressed packet has been sent
+    int zeof;                   // conn_input returned -1
+    uint32_t* htab;             // lz_compress positions in zbuf
+    uint64_t z_raw;             // input bytes sent while compressing
+    uint64_t z_wire;            // payload bytes they took
+    uint8_t* unz;               // history, then the batch being delivered (LZ_WINDOW + UNZ_SIZE)
+    size_t unz_hist;            // length of the history
+    int unz_on;                 // a compressed packet has been delivered
+    int unz_bad;                // one failed to decompress: give up
+
 };
-rel_t *rel_list;
+static __thread rel_t *rel_list;	/* one list per event loop thread */
 
 
 packet_t* rel_make_data_pkt(uint16_t n, uint32_t seqno, char data[500], uint32_t ackno){
@@ -66,35 +166,469 @@ packet_t* rel_make_eof_pkt(uint32_t seqno, uint32_t ackno){
     return pkt;
 }
 
-packet_t* rel_make_ack_pkt(uint32_t ackno){
-    // creates a ack packet from the params
-    packet_t *pkt = xmalloc (sizeof (packet_t));
-    pkt->ackno = htonl(ackno);
-    pkt->cksum = htons(0);
-    pkt->len = htons(8);
-    pkt->cksum = cksum(pkt, 8);
-    return pkt;
+/**
+ * Number of packets past rec_ackno we can take now: the free reorder slots, and while
+ * output is backing up, no more than the output has room for.
+ *
+ * @param   r       Reliable state
+ *
+ * @return  Window to advertise
+*/
+static int rel_rec_window(rel_t* r){
+    int wnd = r->rec_sliding_window_start + r->rec_max_window_size - r->rec_ackno + 1;
+    int waiting = r->rec_ackno - 1 - r->rec_sliding_window_start;
+    if(waiting > 0){
+        int room = (int) (conn_bufroom(r->c) / PKT_DATA) - waiting;
+        if(room < wnd){
+            wnd = room;
+        }
+    }
+    return wnd < 0 ? 0 : wnd > 0xffff ? 0xffff : wnd;
 }
 
-void rel_resend_pkts(rel_t* s){
-    // Now in milliseconds
-    struct timeval now;
-    gettimeofday(&now, NULL);
-    long now_ms = now.tv_sec * 1000 + now.tv_usec / 1000;
+/**
+ * Send an ACK for everything up to rec_ackno, with our window if we advertise it.
+ *
+ * @param   r       Reliable state
+*/
+static void rel_send_ack(rel_t* r){
+    packet_t pkt;
+    size_t n = 8;
+    pkt.ackno = htonl(r->rec_ackno);
+    if(r->advertise){
+        uint16_t wnd;
+        r->rec_adv_wnd = rel_rec_window(r);
+        wnd = htons(r->rec_adv_wnd);
+        memcpy((char*) &pkt + offsetof(struct ack_wnd_packet, window), &wnd, sizeof(wnd));
+        n = sizeof(struct ack_wnd_packet);
+    }
+    pkt.len = htons(n);
+    pkt.cksum = htons(0);
+    pkt.cksum = cksum(&pkt, n);
+    conn_sendpkt(r->c, &pkt, n);
+}
+
+// Length of a packet, without the LEN_LZ flag
+static size_t rel_pkt_len(packet_t* pkt){
+    return ntohs(pkt->len) & ~LEN_LZ;
+}
+
+/**
+ * Send a packet from the send buffer, with the current ackno.
+ * Header-only nodes get their payload back from the mapped input.
+ *
+ * @param   s       Reliable state
+ * @param   node    Send buffer node
+*/
+void rel_send_node(rel_t* s, buffer_node_t* node){
+    // an ack could now be for either copy, or held up by this one
+    s->rtt_seqno = 0;
+    node->packet.ackno = htonl(s->rec_ackno);
+    node->packet.cksum = htons(0);
+    if(node->header_only){
+        packet_t pkt;
+        size_t n = ntohs(node->packet.len) - 12;
+        memcpy(&pkt, &node->packet, 12);
+        memcpy(pkt.data, conn_input_map(s->c, NULL) + node->payload_offset, n);
+        pkt.cksum = cksum(&pkt, n + 12);
+        conn_sendpkt(s->c, &pkt, n + 12);
+    } else {
+        node->packet.cksum = cksum(&node->packet, rel_pkt_len(&node->packet));
+        conn_sendpkt(s->c, &node->packet, rel_pkt_len(&node->packet));
+    }
+}
+
+/**
+ * FNV-1a hash.
+ *
+ * @param   p       Data
+ * @param   n       Length of data
+ * @param   h       Hash so far (14695981039346656037 to start)
+ *
+ * @return  Hash including the data
+*/
+static uint64_t rel_fnv(const char* p, size_t n, uint64_t h){
+    for(size_t i = 0; i < n; i++){
+        h = (h ^ (unsigned char) p[i]) * 1099511628211ULL;
+    }
+    return h;
+}
+
+/**
+ * Hash the last bytes delivered in this run (at most CKPT_TAIL).
+ *
+ * @param   r       Reliable state
+ * @param   len     Set to the number of bytes hashed
+ *
+ * @return  Hash of the bytes before rec_offset
+*/
+static uint64_t rel_tail_hash(rel_t* r, uint32_t* len){
+    uint64_t n = r->rec_offset - r->rec_run_start;
+    size_t k = n < CKPT_TAIL ? n : CKPT_TAIL;
+    size_t at = (r->rec_offset - k) % CKPT_TAIL;
+    size_t first = k < CKPT_TAIL - at ? k : CKPT_TAIL - at;
+    uint64_t h = rel_fnv(r->rec_tail + at, first, 14695981039346656037ULL);
+    *len = k;
+    return rel_fnv(r->rec_tail, k - first, h);
+}
+
+/**
+ * Account for a batch of output, keeping its last bytes for the checkpoint hash.
+ *
+ * @param   r       Reliable state
+ * @param   iov     Payloads delivered
+ * @param   iovcnt  Number of payloads
+ * @param   total   Their total length
+*/
+static void rel_tail_append(rel_t* r, const struct iovec* iov, int iovcnt, size_t total){
+    // only the last CKPT_TAIL bytes of the batch can end up in the tail
+    size_t skip = total > CKPT_TAIL ? total - CKPT_TAIL : 0;
+    uint64_t off = r->rec_offset;
+    for(int i = 0; i < iovcnt; i++){
+        const char* p = iov[i].iov_base;
+        size_t n = iov[i].iov_len;
+        if(skip >= n){
+            skip -= n;
+            off += n;
+            continue;
+        }
+        p += skip;
+        n -= skip;
+        off += skip;
+        skip = 0;
+        while(n > 0){
+            size_t at = off % CKPT_TAIL;
+            size_t k = n < CKPT_TAIL - at ? n : CKPT_TAIL - at;
+            memcpy(r->rec_tail + at, p, k);
+            p += k;
+            n -= k;
+            off += k;
+        }
+    }
+    r->rec_offset += total;
+}
+
+/**
+ * Record progress in the checkpoint file (replaced atomically).
+ *
+ * @param   r       Reliable state
+*/
+static void rel_ckpt_write(rel_t* r){
+    char tmp[4096];
+    uint32_t hashlen;
+    uint64_t hash = rel_tail_hash(r, &hashlen);
+    snprintf(tmp, sizeof(tmp), "%s.tmp", r->checkpoint);
+    FILE* f = fopen(tmp, "w");
+    if(f == NULL){
+        perror(tmp);
+        return;
+    }
+    // highest contiguous seqno delivered (of this run), output offset, hash
+    fprintf(f, "%d %llu %u %016llx\n", r->rec_sliding_window_start,
+            (unsigned long long) r->rec_offset, hashlen, (unsigned long long) hash);
+    if(fclose(f) != 0 || rename(tmp, r->checkpoint) != 0){
+        perror(r->checkpoint);
+        return;
+    }
+    r->ckpt_offset = r->rec_offset;
+    r->ckpt_last = clock_now_ms();
+}
+
+/**
+ * Load the checkpoint file, if there is one, and cut the output back to it.
+ *
+ * @param   r       Reliable state
+*/
+static void rel_ckpt_load(rel_t* r){
+    unsigned long long offset, hash;
+    unsigned int hashlen;
+    int seqno;
+    FILE* f = fopen(r->checkpoint, "r");
+    if(f == NULL){
+        return;
+    }
+    if(fscanf(f, "%d %llu %u %llx", &seqno, &offset, &hashlen, &hash) != 4 || hashlen > CKPT_TAIL){
+        fprintf(stderr, "%s: bad checkpoint, starting over\n", r->checkpoint);
+    } else if(offset > 0 && conn_output_rewind(r->c, offset) < 0){
+        fprintf(stderr, "%s: output does not match checkpoint, starting over\n", r->checkpoint);
+    } else {
+        r->resume_offset = offset;
+        r->resume_hash = hash;
+        r->resume_hashlen = hashlen;
+        r->rec_offset = r->rec_run_start = r->ckpt_offset = offset;
+    }
+    fclose(f);
+}
+
+/**
+ * Send our control packet.
+ *
+ * @param   r       Reliable state
+*/
+static void rel_ctrl_send(rel_t* r){
+    packet_t pkt;
+    ctrl_t ctl;
+    ctl.offset[0] = htonl(r->resume_offset >> 32);
+    ctl.offset[1] = htonl(r->resume_offset);
+    ctl.hash[0] = htonl(r->resume_hash >> 32);
+    ctl.hash[1] = htonl(r->resume_hash);
+    ctl.hashlen = htonl(r->resume_hashlen);
+    ctl.from[0] = htonl(r->send_from >> 32);
+    ctl.from[1] = htonl(r->send_from);
+    ctl.flags = htonl(CTRL_LZ | (r->ctrl_got_peer ? CTRL_HAVE : 0)
+                      | (r->ctrl_got_peer && r->ctrl_peer_has_ours ? 0 : CTRL_WANT));
+    memcpy(pkt.data, &ctl, sizeof(ctl));
+    pkt.len = htons(12 + sizeof(ctl));
+    pkt.seqno = htonl(0);
+    pkt.ackno = htonl(r->rec_ackno);
+    pkt.cksum = htons(0);
+    pkt.cksum = cksum(&pkt, 12 + sizeof(ctl));
+    conn_sendpkt(r->c, &pkt, 12 + sizeof(ctl));
+    r->ctrl_last_sent = clock_now_ms();
+    conn_timer(r->c, r->timeout + 1);
+}
+
+/**
+ * Seek our input to where the peer wants it, if it is the input the peer got the start of.
+ *
+ * @param   r           Reliable state
+ * @param   offset      Offset the peer offered
+ * @param   hashlen     Number of bytes before offset the hash covers
+ * @param   hash        Hash of those bytes
+*/
+static void rel_resume_input(rel_t* r, uint64_t offset, uint32_t hashlen, uint64_t hash){
+    char tail[CKPT_TAIL];
+    r->send_from = 0;
+    if(offset == 0){
+        return;
+    }
+    if(hashlen <= CKPT_TAIL && hashlen <= offset
+            && conn_input_pread(r->c, tail, hashlen, offset - hashlen) == (ssize_t) hashlen
+            && rel_fnv(tail, hashlen, 14695981039346656037ULL) == hash
+            && conn_input_seek(r->c, offset) == 0){
+        fprintf(stderr, "resuming at offset %llu\n", (unsigned long long) offset);
+        r->send_from = offset;
+    } else {
+        fprintf(stderr, "cannot resume at offset %llu, starting over\n", (unsigned long long) offset);
+    }
+}
+
+/**
+ * Handle the peer's control packet.
+ *
+ * @param   r       Reliable state
+ * @param   pkt     Control packet
+ * @param   n       Its length
+*/
+static void rel_ctrl_recv(rel_t* r, packet_t* pkt, size_t n){
+    ctrl_t ctl;
+    if(n < 12 + sizeof(ctl)){
+        return;
+    }
+    memcpy(&ctl, pkt->data, sizeof(ctl));
+    uint32_t flags = ntohl(ctl.flags);
+
+    if(flags & CTRL_LZ){
+        r->peer_lz = 1;
+    }
+    if(!r->ctrl_got_peer){
+        r->ctrl_got_peer = 1;
+        if(r->checkpoint != NULL){
+            rel_resume_input(r, (uint64_t) ntohl(ctl.offset[0]) << 32 | ntohl(ctl.offset[1]),
+                             ntohl(ctl.hashlen), (uint64_t) ntohl(ctl.hash[0]) << 32 | ntohl(ctl.hash[1]));
+        }
+    }
+    if((flags & CTRL_HAVE) && !r->ctrl_peer_has_ours){
+        r->ctrl_peer_has_ours = 1;
+        uint64_t from = (uint64_t) ntohl(ctl.from[0]) << 32 | ntohl(ctl.from[1]);
+        // the peer could not resume where we offered: start the output over
+        if(from != r->rec_offset){
+            if(from != 0 || conn_output_rewind(r->c, 0) < 0){
+                fprintf(stderr, "peer starts at offset %llu, output may be wrong\n", (unsigned long long) from);
+            }
+            r->rec_offset = r->rec_run_start = r->ckpt_offset = from;
+        }
+    }
+    if(flags & CTRL_WANT){
+        rel_ctrl_send(r);
+    }
+    if(r->ctrl_pending && r->ctrl_got_peer && r->ctrl_peer_has_ours){
+        r->ctrl_pending = 0;
+        conn_defer_read(r->c);
+    }
+}
+
+/**
+ * Get the payload of the next data packet: raw input, or once the peer can take it,
+ * as much input as compresses into one packet, if that is more than fits raw.
+ *
+ * @param   r       Reliable state
+ * @param   data    Where to put the payload
+ * @param   lz      Set to 1 iff the payload is compressed
+ *
+ * @return  Payload length, 0 if no input is available, -1 on EOF or error
+*/
+static int rel_next_payload(rel_t* r, char data[500], int* lz){
+    *lz = 0;
+    if(!r->compress){
+        return conn_input(r->c, data, 500);
+    }
+
+    // keep LZ_WINDOW bytes of history in front of the input, LZ_MAX_RAW of input after it
+    if(r->zend + LZ_MAX_RAW > ZBUF_SIZE && r->zpos > LZ_WINDOW){
+        size_t d = r->zpos - LZ_WINDOW;
+        memmove(r->zbuf, r->zbuf + d, r->zend - d);
+        r->zpos -= d;
+        r->zend -= d;
+        r->zlo = r->zlo > d ? r->zlo - d : 0;
+        lz_shift(r->htab, d);
+    }
+    while(!r->zeof && r->zend - r->zpos < LZ_MAX_RAW && r->zend < ZBUF_SIZE){
+        int n = conn_input(r->c, (char*) r->zbuf + r->zend, ZBUF_SIZE - r->zend);
+        if(n < 0){
+            r->zeof = 1;
+        } else if(n == 0){
+            break;
+        } else {
+            r->zend += n;
+        }
+    }
+    size_t avail = r->zend - r->zpos;
+    if(avail == 0){
+        return r->zeof ? -1 : 0;
+    }
+
+    size_t zlen = 0, n;
+    size_t used = 0;
+    if(r->peer_lz){
+        size_t lo = r->zpos;
+        if(r->zon){
+            lo = r->zpos - r->zlo > LZ_WINDOW ? r->zpos - LZ_WINDOW : r->zlo;
+        }
+        size_t end = avail > LZ_MAX_RAW ? r->zpos + LZ_MAX_RAW : r->zend;
+        used = lz_compress(r->zbuf, lo, r->zpos, end, (uint8_t*) data + 2, 498, &zlen, r->htab);
+    }
+    if(used > 0 && zlen + 2 < used){
+        data[0] = used >> 8;
+        data[1] = used & 0xff;
+        n = zlen + 2;
+        *lz = 1;
+        if(!r->zon){
+            r->zon = 1;
+            r->zlo = r->zpos;
+        }
+    } else {
+        // doesn't help: send raw
+        used = avail < 500 ? avail : 500;
+        memcpy(data, r->zbuf + r->zpos, used);
+        n = used;
+    }
+    r->zpos += used;
+    r->z_raw += used;
+    r->z_wire += n;
+    return n;
+}
 
+/**
+ * Resend the packets whose timeout has expired.
+ *
+ * @param   s       Reliable state
+ * @param   now_ms  Now in milliseconds
+ *
+ * @return  Milliseconds until the next one expires, -1 if nothing is in flight
+*/
+static long rel_resend_pkts(rel_t* s, long now_ms){
+    long next = -1;
     buffer_node_t* node = buffer_get_first(s->send_buffer);
     while(node != NULL){
         if(node->last_retransmit + s->timeout < now_ms){
-            node->packet.ackno = htonl(s->rec_ackno);
-            node->packet.cksum = htons(0);
-            node->packet.cksum = cksum(&node->packet, ntohs(node->packet.len));
-            conn_sendpkt(s->c, &node->packet, ntohs(node->packet.len));
+            rel_send_node(s, node);
             node->last_retransmit = now_ms;
-            return;
-            
+        }
+        long due = node->last_retransmit + s->timeout + 1 - now_ms;
+        if(next < 0 || due < next){
+            next = due;
         }
         node = node->next;
     }
+    return next;
+}
+
+/**
+ * Fold a round-trip time sample into the estimate, and let the library size the
+ * output buffering by it.
+ *
+ * @param   r       Reliable state
+ * @param   ms      Sample in milliseconds
+*/
+static void rel_rtt_sample(rel_t* r, long ms){
+    long rtt = ms > 0 ? ms * 1000 : 500;    // below the clock's resolution
+    if(r->srtt == 0){
+        r->srtt = rtt;
+        r->rttvar = rtt / 2;
+    } else {
+        long d = rtt - r->srtt;
+        r->rttvar += ((d < 0 ? -d : d) - r->rttvar) / 4;
+        r->srtt += d / 8;
+    }
+    conn_set_rtt(r->c, (r->srtt + 999) / 1000);
+}
+
+/**
+ * Arm the tail loss probe for two smoothed round trips from now, if packets are in
+ * flight and that comes well before their timeout.  Only one probe goes out until an
+ * ack makes progress.
+ *
+ * @param   r       Reliable state
+ * @param   now_ms  Now in milliseconds
+*/
+static void rel_tlp_arm(rel_t* r, long now_ms){
+    long pto = 2 * ((r->srtt + 999) / 1000);
+    r->tlp_at = 0;
+    if(r->srtt == 0 || r->tlp_sent || pto >= r->timeout / 2 || buffer_get_first(r->send_buffer) == NULL){
+        return;
+    }
+    r->tlp_at = now_ms + pto;
+    conn_timer(r->c, pto);
+}
+
+/**
+ * Check whether both directions are finished: everything we sent, our EOF included, is
+ * acknowledged, and everything up to the peer's EOF is written out.
+ *
+ * @param   r       Reliable state
+ *
+ * @return  1 if so, 0 otherwise
+*/
+static int rel_done(rel_t* r){
+    return r->send_eof == 1 && buffer_size(r->send_buffer) == 0
+        && r->rec_eof == 1 && buffer_size(r->rec_buffer) == 0;
+}
+
+/**
+ * Take an ack from the peer.  Acks that acknowledge nothing new (duplicates, or ones
+ * overtaken by later ones) are dropped before the send buffer is looked at.
+ *
+ * @param   r       Reliable state
+ * @param   ackno   Its ackno
+*/
+static void rel_acked(rel_t* r, uint32_t ackno){
+    if(ackno <= (uint32_t) r->send_sliding_window_start || ackno > (uint32_t) r->send_next_not_alloc){
+        return;
+    }
+    r->send_sliding_window_start = ackno;
+    buffer_remove(r->send_buffer, ackno);
+    if(r->rtt_seqno != 0 && ackno > r->rtt_seqno){
+        rel_rtt_sample(r, clock_now_ms() - r->rtt_sent);
+        r->rtt_seqno = 0;
+    }
+    r->tlp_sent = 0;
+    rel_tlp_arm(r, clock_now_ms());
+    // the window opened: read once this batch of packets is in
+    conn_defer_read(r->c);
+    if(rel_done(r)){
+        conn_timer(r->c, 0);
+    }
 }
 
 
@@ -146,6 +680,24 @@ const struct config_common *cc)
     r->rec_buffer = xmalloc(sizeof(buffer_t));
     r->rec_buffer->head = NULL;
 
+    // without a checkpoint file there is nothing to agree on before sending
+    r->checkpoint = cc->single_connection ? cc->checkpoint : NULL;
+    if(r->checkpoint != NULL){
+        r->ctrl_pending = 1;
+        rel_ckpt_load(r);
+    } else {
+        // compressing needs to hear from the peer first, but doesn't wait for it
+        r->ctrl_got_peer = !cc->compress;
+        r->ctrl_peer_has_ours = 1;
+    }
+    r->compress = cc->compress;
+    r->advertise = cc->advertise;
+    if(r->compress){
+        r->zbuf = xmalloc(ZBUF_SIZE);
+        r->htab = xmalloc(LZ_HASH_SIZE * sizeof(uint32_t));
+        memset(r->htab, 0, LZ_HASH_SIZE * sizeof(uint32_t));
+    }
+
     return r;
 }
 
@@ -162,17 +714,57 @@ rel_destroy (rel_t *r)
     free(r->send_buffer);
     buffer_clear(r->rec_buffer);
     free(r->rec_buffer);
+    if(r->z_raw > 0){
+        fprintf(stderr, "compression: %llu bytes sent in %llu (%.2fx)\n", (unsigned long long) r->z_raw,
+                (unsigned long long) r->z_wire, (double) r->z_raw / r->z_wire);
+    }
+    free(r->zbuf);
+    free(r->htab);
+    free(r->unz);
+    for(int i = 0; i < RECV_BATCH; i++){
+        free(r->rxslots[i]);
+    }
     // ...
     free(r);
 }
 
 
+packet_t *
+rel_rxslot (rel_t *r, int i)
+{
+    // datagrams are received into reorder buffer nodes, so that data packets
+    // can be buffered without being copied
+    if(r->rxslots[i] == NULL){
+        r->rxslots[i] = buffer_node_alloc();
+    }
+    return &r->rxslots[i]->packet;
+}
+
+/**
+ * Take over the receive slot a packet lies in, if any.
+ *
+ * @param   r       Reliable state
+ * @param   pkt     Received packet
+ *
+ * @return  The slot's node, now owned by the caller (NULL if pkt is not in a slot)
+*/
+static buffer_node_t* rel_take_rxslot(rel_t *r, packet_t *pkt){
+    for(int i = 0; i < RECV_BATCH; i++){
+        if(r->rxslots[i] != NULL && &r->rxslots[i]->packet == pkt){
+            buffer_node_t* node = r->rxslots[i];
+            r->rxslots[i] = NULL;
+            return node;
+        }
+    }
+    return NULL;
+}
+
 void
 rel_recvpkt (rel_t *r, packet_t *pkt, size_t n)
 {
     // translate from networkt to host
     uint16_t checksum = ntohs(pkt->cksum);
-    size_t pkt_size = ntohs(pkt->len);
+    size_t pkt_size = rel_pkt_len(pkt);
     size_t ackno = ntohl(pkt->ackno);
 
     // reset cksum
@@ -183,10 +775,39 @@ rel_recvpkt (rel_t *r, packet_t *pkt, size_t n)
         return;
     }
 
-    // ack packet
+    // plain ack: the common case while sending, so check for it first
     if(n == 8){
-        if(buffer_remove(r->send_buffer, ackno) > 0){
-            rel_read(r);
+        rel_acked(r, ackno);
+        return;
+    }
+
+    // ack packet with the peer's window
+    if(n == 10){
+        if(ackno >= r->send_wnd_ackno){
+            uint16_t wnd;
+            memcpy(&wnd, (char*) pkt + offsetof(struct ack_wnd_packet, window), sizeof(wnd));
+            uint32_t edge = ackno + ntohs(wnd);
+            if(!r->peer_wnd || edge > r->send_wnd_edge){
+                conn_defer_read(r->c);
+            }
+            r->peer_wnd = 1;
+            r->send_wnd_ackno = ackno;
+            r->send_wnd_edge = edge;
+        }
+        rel_acked(r, ackno);
+        return;
+    }
+
+    // control packet
+    if(n >= 12 && ntohl(pkt->seqno) == 0){
+        rel_ctrl_recv(r, pkt, n);
+        return;
+    }
+
+    // data from a peer that doesn't know where we are yet (or we don't know where it is)
+    if(!r->ctrl_peer_has_ours){
+        if(r->ctrl_last_sent == 0){
+            rel_ctrl_send(r);
         }
         return;
     }
@@ -197,15 +818,31 @@ rel_recvpkt (rel_t *r, packet_t *pkt, size_t n)
         uint32_t seqno = ntohl(pkt->seqno);
         //fprintf(stderr, "packet arrived : %i\n", seqno);
 
+        // the common case: the next packet in order, with nothing held back before or
+        // after it and room for it in the output.  Write it out from the receive slot
+        // right away, without going through the reorder buffer
+        if(seqno == (uint32_t) r->rec_ackno && n > 12 && !(ntohs(pkt->len) & LEN_LZ)
+                && buffer_get_first(r->rec_buffer) == NULL && !r->rec_eof && !r->unz_on
+                && r->checkpoint == NULL && conn_bufspace(r->c) >= n - 12){
+            conn_output(r->c, pkt->data, n - 12);
+            r->rec_sliding_window_start = seqno;
+            r->rec_ackno = seqno + 1;
+            rel_send_ack(r);
+            return;
+        }
+
         // check whether packet outside sliding window;
         if(r->rec_sliding_window_start + r->rec_max_window_size < seqno){
             fprintf(stderr, "packet outside sliding window : %i, %i\n", seqno, r->rec_ackno);
+            // a probe of our closed window: tell it where the window is
+            if(r->advertise){
+                rel_send_ack(r);
+            }
             return;
         }
         if(r->rec_ackno > seqno){
             // send ack
-            packet_t* ack_pkt = rel_make_ack_pkt(r->rec_ackno);
-            conn_sendpkt(r->c, ack_pkt, 8);
+            rel_send_ack(r);
             return;
         }
 
@@ -215,8 +852,17 @@ rel_recvpkt (rel_t *r, packet_t *pkt, size_t n)
             r->rec_eof = 1;
         }
 
-        // insert new packet
-        buffer_insert(r->rec_buffer, pkt, 0);
+        // insert new packet, unless a copy of it is already buffered
+        // (retransmissions can overtake reordered originals)
+        if(!buffer_contains(r->rec_buffer, seqno)){
+            // keep the node it was received into where possible
+            buffer_node_t* slot = rel_take_rxslot(r, pkt);
+            if(slot != NULL){
+                buffer_insert_node(r->rec_buffer, slot, 0);
+            } else {
+                buffer_insert(r->rec_buffer, pkt, 0);
+            }
+        }
 
         // update ackno
         buffer_node_t* node = buffer_get_first(r->rec_buffer);
@@ -227,104 +873,300 @@ rel_recvpkt (rel_t *r, packet_t *pkt, size_t n)
             node = node->next;
         }
 
-        // send ack
-        packet_t* ack_pkt = rel_make_ack_pkt(r->rec_ackno);
-        conn_sendpkt(r->c, ack_pkt, 8);
-
-        // try to output the received packet
+        // try to output the received packet, then ack it (with the window that leaves)
         rel_output(r);
+        rel_send_ack(r);
 
         return;
     }
 }
 
 
+/**
+ * Check whether another packet may be sent: our window is not full, and the peer, if it
+ * advertises a window, has room for it.  With nothing in flight one packet may go
+ * anyway, so that a closed window gets probed.
+ *
+ * @param   r       Reliable state
+ *
+ * @return  1 if so, 0 otherwise
+*/
+static int rel_send_open(rel_t* r){
+    int inflight = buffer_size(r->send_buffer);
+    if(inflight >= r->send_max_window_size){
+        return 0;
+    }
+    return !r->peer_wnd || inflight == 0 || (uint32_t) r->send_next_not_alloc < r->send_wnd_edge;
+}
+
 void
 rel_read (rel_t *r)
 {
     // return if slidingwindow is at max size or there is already a small packet in the queue
-    if(buffer_size(r->send_buffer) >= r->send_max_window_size || r->send_eof == 1){
+    if(!rel_send_open(r) || r->send_eof == 1){
+        return;
+    }
+
+    // hold data back until we know where to start, and offer ours once there is some
+    if(r->ctrl_pending){
+        if(r->ctrl_last_sent == 0 && conn_input_avail(r->c) != 0){
+            rel_ctrl_send(r);
+        }
         return;
     }
 
     // Now in milliseconds
-    struct timeval now;
-    gettimeofday(&now, NULL);
-    long now_ms = now.tv_sec * 1000 + now.tv_usec / 1000;
+    long now_ms = clock_now_ms();
+
+    // ask whether the peer takes compressed packets, once there's something to send
+    if(!r->ctrl_got_peer && r->ctrl_last_sent == 0 && conn_input_avail(r->c) != 0){
+        rel_ctrl_send(r);
+    }
+
+    // with a mapped input file, only packet headers need to be kept for retransmissions
+    // (payloads of raw packets, that is)
+    size_t offset;
+    const char* map = r->compress ? NULL : conn_input_map(r->c, &offset);
 
     char data[500];
-    int data_len = conn_input(r->c, data, 500);
+    int lz;
+    int data_len = rel_next_payload(r, data, &lz);
     while(data_len > 0 && buffer_size(r->send_buffer) < r->send_max_window_size){
 
         packet_t* pkt = rel_make_data_pkt(data_len, r->send_next_not_alloc, data, r->rec_ackno);
-        buffer_insert(r->send_buffer, pkt, now_ms);
+        if(lz){
+            pkt->len = htons((data_len + 12) | LEN_LZ);
+            pkt->cksum = htons(0);
+            pkt->cksum = cksum(pkt, data_len + 12);
+        }
+        if(map != NULL){
+            buffer_insert_header(r->send_buffer, pkt, offset, now_ms);
+        } else {
+            buffer_insert(r->send_buffer, pkt, now_ms);
+        }
+        offset += data_len;
+        if(r->rtt_seqno == 0){
+            r->rtt_seqno = r->send_next_not_alloc;
+            r->rtt_sent = now_ms;
+        }
         r->send_next_not_alloc++;
-        conn_sendpkt(r->c, pkt, ntohs(pkt->len));
-        if(buffer_size(r->send_buffer) >= r->send_max_window_size){
+        conn_sendpkt(r->c, pkt, rel_pkt_len(pkt));
+        conn_timer(r->c, r->timeout + 1);
+        rel_tlp_arm(r, now_ms);
+        free(pkt);
+        if(!rel_send_open(r)){
             return;
         }
-        data_len = conn_input(r->c, data, 500);
+        data_len = rel_next_payload(r, data, &lz);
     }
     if(data_len == -1){
         packet_t* pkt = rel_make_eof_pkt(r->send_next_not_alloc, r->rec_ackno);
         buffer_insert(r->send_buffer, pkt, now_ms);
         conn_sendpkt(r->c, pkt, 12);
+        free(pkt);
+        conn_timer(r->c, r->timeout + 1);
+        rel_tlp_arm(r, now_ms);
         r->send_next_not_alloc++;
         r->send_eof = 1;
     }
 
 }
 
+// Upper bound on the payloads handed to conn_outputv at once
+#define REL_OUTPUT_BATCH 64
+
 void
 rel_output (rel_t *r)
 {
-    uint16_t space = (uint16_t)conn_bufspace(r->c);
+    struct iovec iov[REL_OUTPUT_BATCH];
+    int iovcnt = 0;
+    size_t space = conn_bufspace(r->c);
+    size_t total = 0;
+    size_t unz_used = 0;
+    uint32_t last_seqno = 0;
+    int more = 0;          // stopped short of the last packet in order
+
+    // a packet failed to decompress: nothing after it can be delivered
+    if(r->unz_bad){
+        return;
+    }
+
+    // gather all in-order payloads that fit in the output buffer
     buffer_node_t* node = buffer_get_first(r->rec_buffer);
-    while(node != NULL){
-        // check whether there is enough space in the output buffer
-        if(space < ntohs(node->packet.len) - 12){
-            return;
+    while(node != NULL && iovcnt < REL_OUTPUT_BATCH){
+        size_t len = rel_pkt_len(&node->packet) - 12;
+        char* data = node->packet.data;
+        // stop at the first packet not yet in order, or the eof
+        if(ntohl(node->packet.seqno) >= r->rec_ackno || len == 0){
+            break;
         }
-        // check if all previous packets have arrived
-        if(ntohl(node->packet.seqno) >= r->rec_ackno){
-            return;
+        if(ntohs(node->packet.len) & LEN_LZ){
+            size_t raw = (uint8_t) data[0] << 8 | (uint8_t) data[1];
+            if(total + raw > space || unz_used + raw > UNZ_SIZE){
+                more = 1;
+                break;
+            }
+            if(r->unz == NULL){
+                r->unz = xmalloc(LZ_WINDOW + UNZ_SIZE);
+            }
+            r->unz_on = 1;
+            size_t at = r->unz_hist + unz_used;
+            if(len < 2 || lz_decompress((uint8_t*) data + 2, len - 2, r->unz, at, at + raw) != (long) raw){
+                // the stream can't go on past it: fail the connection, which
+                // rel_timer destroys (our caller may still be using r)
+                fprintf(stderr, "bad compressed packet %u, giving up\n", ntohl(node->packet.seqno));
+                r->unz_bad = 1;
+                break;
+            }
+            data = (char*) r->unz + at;
+            unz_used += raw;
+            len = raw;
+        } else if(total + len > space || (r->unz_on && unz_used + len > UNZ_SIZE)){
+            // stop at one that does not fit
+            more = 1;
+            break;
+        } else if(r->unz_on){
+            // raw packets are history for the compressed ones after them, too
+            memcpy(r->unz + r->unz_hist + unz_used, data, len);
+            unz_used += len;
+        }
+        iov[iovcnt].iov_base = data;
+        iov[iovcnt].iov_len = len;
+        iovcnt++;
+        total += len;
+        last_seqno = ntohl(node->packet.seqno);
+        node = node->next;
+    }
+
+    // hand them over in one go, and drop them from the buffer
+    if(iovcnt > 0){
+        conn_outputv(r->c, iov, iovcnt);
+        if(r->checkpoint != NULL){
+            rel_tail_append(r, iov, iovcnt, total);
+        }
+        r->rec_sliding_window_start = last_seqno;
+        buffer_remove(r->rec_buffer, last_seqno + 1);
+        if(r->checkpoint != NULL){
+            long wait = r->ckpt_last + CKPT_INTERVAL + 1 - clock_now_ms();
+            conn_timer(r->c, wait > 0 ? wait : 0);
+        }
+        // come back for the rest, which may fit now that this went out
+        // (when nothing does, conn_output's drain calls rel_output)
+        if(more || iovcnt == REL_OUTPUT_BATCH){
+            conn_defer_output(r->c);
+        }
+        // the sender may be waiting for the window this opened
+        if(r->advertise){
+            int wnd = rel_rec_window(r);
+            if(wnd > r->rec_adv_wnd && (r->rec_adv_wnd == 0
+                    || wnd - r->rec_adv_wnd >= r->rec_max_window_size / 2)){
+                rel_send_ack(r);
+            }
         }
-        conn_output(r->c, node->packet.data, ntohs(node->packet.len) - 12);
-        space = (uint16_t)conn_bufspace(r->c);
+    }
+
+    // keep the last LZ_WINDOW bytes delivered as history for the next batch
+    if(unz_used > 0){
+        size_t end = r->unz_hist + unz_used;
+        size_t keep = end < LZ_WINDOW ? end : LZ_WINDOW;
+        memmove(r->unz, r->unz + end - keep, keep);
+        r->unz_hist = keep;
+    }
+
+    if(r->unz_bad){
+        conn_abort(r->c);
+        conn_timer(r->c, 0);
+        return;
+    }
+
+    // eof, once everything before it has been written
+    node = buffer_get_first(r->rec_buffer);
+    if(node != NULL && ntohl(node->packet.seqno) < r->rec_ackno && ntohs(node->packet.len) == 12){
+        conn_output(r->c, node->packet.data, 0);
         r->rec_sliding_window_start = ntohl(node->packet.seqno);
         buffer_remove_first(r->rec_buffer);
-        node = node->next;
+        if(r->checkpoint != NULL){
+            rel_ckpt_write(r);
+        }
+    }
+    if(rel_done(r)){
+        conn_timer(r->c, 0);
     }
 }
 
 void
-rel_timer ()
+rel_timer (rel_t *r)
 {
-    // Go over all reliable senders, and have them send out
-    // all packets whose timer has expired
-    rel_t *current = rel_list;
-    rel_t *dest;
-    while (current != NULL) {
-
-        rel_read(current);
-
-        // try outputing data
-        rel_output(current);
-
-        // resend packets whose timout has been triggered
-        rel_resend_pkts(current);
-
-        // check whether the connection can be destroyed
-        dest = current;
-        current = current->next;
-        if(dest->send_eof == 1 && buffer_size(dest->send_buffer) <= 1 ){
-            if(dest->rec_eof == 1 && buffer_size(dest->rec_buffer) == 0){
-                fprintf(stderr, "connection destroyed\n");
-                rel_destroy(dest);
+    // resend packets whose timout has been triggered
+    long now_ms = clock_now_ms();
+
+    // rel_output could not decompress a packet
+    if(r->unz_bad){
+        rel_destroy(r);
+        return;
+    }
+
+    // the ack for our EOF is all we are waiting for: the peer may have had everything
+    // and gone, which a server socket never hears about.  Give up after a few resends
+    if(r->send_eof && r->rec_eof && buffer_get_first(r->rec_buffer) == NULL){
+        buffer_node_t* eof = buffer_get_first(r->send_buffer);
+        if(eof != NULL && eof->next == NULL && eof->last_retransmit + r->timeout < now_ms
+                && ++r->eof_resends > EOF_RESENDS){
+            fprintf(stderr, "connection destroyed, EOF not acknowledged\n");
+            rel_destroy(r);
+            return;
+        }
+    }
+
+    long next = rel_resend_pkts(r, now_ms);
+
+    // nothing heard back for a while: the last packets may all have been lost, and
+    // then nothing else would tell us before the timeout
+    if(r->tlp_at != 0){
+        if(r->tlp_at <= now_ms){
+            buffer_node_t* last = buffer_get_first(r->send_buffer);
+            while(last != NULL && last->next != NULL){
+                last = last->next;
+            }
+            if(last != NULL){
+                rel_send_node(r, last);
             }
+            r->tlp_at = 0;
+            r->tlp_sent = 1;
+        } else if(next < 0 || r->tlp_at - now_ms < next){
+            next = r->tlp_at - now_ms;
+        }
+    }
+
+    // resend our control packet until the peer has it, and record progress
+    if((r->ctrl_pending || !r->ctrl_got_peer) && r->ctrl_last_sent != 0){
+        long due = r->ctrl_last_sent + r->timeout + 1 - now_ms;
+        if(due <= 0){
+            rel_ctrl_send(r);
+            due = r->timeout + 1;
+        }
+        if(next < 0 || due < next){
+            next = due;
+        }
+    }
+    if(r->checkpoint != NULL && r->rec_offset != r->ckpt_offset){
+        long due = r->ckpt_last + CKPT_INTERVAL + 1 - now_ms;
+        if(due <= 0){
+            rel_ckpt_write(r);
+        } else if(next < 0 || due < next){
+            next = due;
         }
     }
 
-    // if s->send_eof == 1 and buffer_size(s->send_buffer) == 0 -> out eof completed
+    // check whether the connection can be destroyed
+    if(rel_done(r)){
+        fprintf(stderr, "connection destroyed\n");
+        rel_destroy(r);
+        return;
+    }
 
+    // and come back when the next of the above is due
+    if(next >= 0){
+        conn_timer(r->c, next);
+    }
 }
@@ -92,7 +92,7 @@ rel_output (rel_t *r)
 }
 
 void
-rel_timer ()
+rel_timer (rel_t *r)
 {
     /* Retransmit any packets that need to be retransmitted */
 
@@ -1,5 +1,7 @@
 /* rlib version 5 */
 
+#define _GNU_SOURCE		/* recvmmsg, sendmmsg */
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <errno.h>
@@ -12,10 +14,30 @@
 #include <assert.h>
 #include <stddef.h>
 #include <sys/socket.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <sys/un.h>
+#include <sys/uio.h>
 #include <netinet/in.h>
+#include <netinet/udp.h>
 #include <poll.h>
 #include <signal.h>
+#include <pthread.h>
+#include <sched.h>
+#ifdef __linux__
+#include <sys/epoll.h>
+#include <sys/ioctl.h>
+#define HAVE_EPOLL 1
+#define HAVE_MMSG 1			/* recvmmsg/sendmmsg */
+#define HAVE_VMSPLICE 1
+#include <sys/eventfd.h>
+#define HAVE_PIPELINE 1			/* -p and -I threads */
+#if defined (__has_include) && __has_include (<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#include <sys/syscall.h>
+#define HAVE_IO_URING 1
+#endif /* __has_include (<linux/io_uring.h>) */
+#endif /* __linux__ */
 
 #include "rlib.h"
 
@@ -32,25 +54,168 @@ struct config_server {
     address */
 };
 
-static struct config_server *serverconf;
+/* Everything an event loop owns is thread-local, so that server mode
+ * can run one independent loop per worker thread (-T). */
+static __thread struct config_server *serverconf;
+static int reuse_port;		/* set SO_REUSEPORT in listen_on */
+static int opt_poll;
 
 static void conn_mkevents (void);
+static void conn_obuf_idle (conn_t *c, uint64_t now);
 static int debug_recv (int s, packet_t *buf, size_t len, int flags,
 struct sockaddr_storage *from);
 
-int cevents_generation;
-static struct pollfd *cevents;
-static int ncevents;
-static conn_t **evreaders;
-static conn_t **evwriters;
-
-struct chunk {
-    struct chunk *next;
-    size_t size;
-    size_t used;
-    char buf[1];
+__thread int cevents_generation;
+static __thread struct pollfd *cevents;
+static __thread int ncevents;
+static __thread conn_t **evreaders;
+static __thread conn_t **evwriters;
+
+/* With epoll, each descriptor is registered once, when its connection
+ * is set up, and only re-armed when the interest set changes.  poll()
+ * over cevents stays as a fallback (--poll, or when epoll is not
+ * available). */
+struct evsrc {
+    conn_t *c;
+    int fd;
+    int events;			/* POLLIN/POLLOUT currently wanted */
+    char added;			/* registered with epfd */
+    char always;			/* epoll refused fd (e.g., regular file) */
+    struct evsrc *anext;		/* list of "always ready" sources */
+};
+
+static __thread int epfd = -1;
+static __thread struct evsrc stderr_src;
+static __thread struct evsrc server_src;
+static __thread struct evsrc *evalways;
+
+/* Datagrams are received up to RECV_BATCH at a time, and sends are
+ * queued and flushed once per conn_poll iteration (or when SENDQ_MAX
+ * packets are pending) with sendmmsg. */
+#define SENDQ_MAX 64
+
+struct sendq_ent {
+    int fd;
+    socklen_t namelen;		/* 0 on connected sockets */
+    struct sockaddr_storage name;
+    size_t len;
+    packet_t pkt;
+};
+
+static __thread struct sendq_ent sendq[SENDQ_MAX];
+static __thread int nsendq;
+
+#if HAVE_MMSG && defined (UDP_SEGMENT) && defined (UDP_GRO)
+/* Segmentation offload (-G): runs of queued packets of equal size to
+ * the same peer go to the kernel as one UDP_SEGMENT datagram, and
+ * client sockets accept GRO-coalesced datagrams, which are split back
+ * into packets before rel_recvpkt. */
+#define HAVE_UDP_GSO 1
+#define GSO_MAX_SEGS 64
+#define GRO_BATCH 8
+#define GRO_BUFSIZE 65536
+static int opt_gso;		/* atomic: any -T worker may turn it off */
+static int conn_failed;		/* atomic: set by conn_abort; exit nonzero */
+static __thread char *grobufs;
+#endif /* UDP_SEGMENT && UDP_GRO */
+
+#if HAVE_PIPELINE
+/* Indices of a ring shared by one producer and one consumer thread.
+ * Either side may sleep on its eventfd once the ring is empty
+ * (consumer) or full (producer): it sets its waits flag first and then
+ * looks at the ring once more, and the other side writes the eventfd
+ * only when it finds the flag set. */
+struct spsc {
+    uint64_t head __attribute__ ((aligned (64)));	/* producer's */
+    uint64_t tail __attribute__ ((aligned (64)));	/* consumer's */
+    int cwaits __attribute__ ((aligned (64)));
+    int pwaits;
+    int cfd;			/* eventfd the consumer sleeps on */
+    int pfd;			/* eventfd the producer sleeps on */
+};
+
+/* Pipelined mode (-p): a client connection's datagrams are received by
+ * one thread and sent by another, each connected to the event loop
+ * (the protocol thread) by a ring of packet slots.  The loop watches
+ * the receive ring's eventfd in place of the socket, and conn_sendpkt
+ * only fills the send ring, which conn_flush hands over. */
+#define PIPE_SLOTS 1024			/* per ring; a power of two */
+
+struct pktslot {
+    int len;			/* -1: the peer is gone (ICMP) */
+    packet_t pkt;
+};
+
+struct netpipe {
+    int nfd;
+    struct spsc rx;		/* RX thread -> loop */
+    struct spsc tx;		/* loop -> TX thread */
+    uint64_t txhead;		/* slots filled, not yet handed over */
+    struct pktslot *rxslots;
+    struct pktslot *txslots;
+    int stop;
+    pthread_t rxtid;
+    pthread_t txtid;
+};
+static __thread struct netpipe *npipe;
+
+/* Stdio thread (-I): all reads of a client connection's input and
+ * writes of its output happen on a thread of their own, through a ring
+ * of bytes each way.  The loop watches one eventfd, for input arrived
+ * or output space freed, in place of rfd and wfd. */
+#define STDIO_RING (256 << 10)
+
+struct sio {
+    int rfd;
+    int wfd;
+    struct spsc in;		/* stdio thread -> loop */
+    struct spsc out;		/* loop -> stdio thread */
+    char *ibuf;
+    char *obuf;
+    int in_eof;			/* rfd is at EOF, or failed */
+    int out_eof;		/* shut wfd down once out is drained */
+    int out_err;		/* writing to wfd failed */
+    int stop;
+    pthread_t tid;
 };
-typedef struct chunk chunk_t;
+#endif /* HAVE_PIPELINE */
+static int opt_pipeline;
+static int opt_stdio;
+
+/* Per-connection output buffering: a byte ring, OUTBUF_SIZE to start
+ * with.  While output backs up, the ring doubles, up to about twice
+ * what drains in a round trip (OUTBUF_MAX at most); once it empties
+ * having used no more than a quarter, it halves again, and once it has
+ * stayed empty for OUTBUF_IDLE it goes back to OUTBUF_SIZE.  What rings
+ * take beyond OUTBUF_SIZE each counts against a process-wide budget
+ * (-B), so busy connections can't starve the rest. */
+#define OUTBUF_SIZE 8192
+#define OUTBUF_MAX (16 << 20)
+#define OUTBUF_RTT 100		/* ms, until conn_set_rtt says otherwise */
+#define OUTBUF_IDLE 1000		/* ms */
+static size_t obuf_budget = 64 << 20;
+static size_t obuf_used;		/* atomic */
+
+#if HAVE_VMSPLICE
+/* Zero-copy output (-z): when the output is a pipe, the ring is mapped
+ * separately, twice the pipe's size, and drained with vmsplice, so the
+ * pipe references its pages instead of copying them.  Bytes spliced
+ * but not yet read by the other end of the pipe (opinned, found with
+ * FIONREAD) must not be overwritten, and count against conn_bufspace. */
+static int opt_splice;
+#endif /* HAVE_VMSPLICE */
+
+/* Input is staged in a byte ring of this size, filled with as few
+ * reads as possible and handed out by conn_input in packet-sized
+ * slices. */
+#define INBUF_SIZE 65536
+
+/* A regular file as input is mapped whole instead (see conn_input_map).
+ * With -m, a regular file as output is written through a shared
+ * mapping of this much of it at a time, preallocated as it goes, and
+ * trimmed to what was written at EOF. */
+#define OUTMAP_CHUNK (16 << 20)
+static int opt_mmap_out;
 
 struct conn {
     rel_t *rel;			/* Data from reliable */
@@ -64,21 +229,280 @@ struct conn {
     int nfd;			/* network file descriptor */
     char server;			/* non-zero on server */
     struct sockaddr_storage peer;	/* network peer */
+    unsigned int hash;		/* addrhash (&peer), on server */
 
     char read_eof;	        /* zero if haven't received EOF */
     char write_eof;		/* send EOF when output queue drained */
     char write_err;	        /* zero if it's okay to write to wfd */
     char xoff;			/* non-zero to pause reading */
     char delete_me;		/* delete after draining */
-    chunk_t *outq;		/* chunks not yet written */
-    chunk_t **outqtail;
+    char *obuf;			/* output ring, allocated on first use */
+    size_t ocap;			/* capacity of obuf */
+    size_t ohead;			/* offset of first byte not yet written */
+    size_t olen;			/* bytes in obuf not yet written */
+    char opipe;			/* obuf is vmspliced into the pipe wfd */
+    size_t opinned;		/* spliced bytes before ohead still in pipe */
+    size_t opeak;			/* most of obuf used since it was empty */
+    size_t obytes;		/* bytes written out since ostamp */
+    uint64_t ostamp;		/* start of the drain rate sample */
+    size_t orate;			/* drain rate, bytes per ms (average) */
+    long ortt;			/* round-trip time (conn_set_rtt), or 0 */
+    uint64_t oidle;		/* when obuf was last found empty */
+    char *ibuf;			/* input ring, allocated on first use */
+    size_t icap;			/* capacity of ibuf */
+    size_t ihead;			/* offset of first byte not yet consumed */
+    size_t ilen;			/* bytes in ibuf not yet consumed */
+    const char *imap;		/* whole input file, if mapped */
+    size_t imaplen;
+    size_t ipos;			/* offset of next byte of imap */
+    int omapfd;			/* wfd reopened for reading and writing */
+    char omapped;			/* output goes through omap (-m) */
+    char *omap;			/* OUTMAP_CHUNK of output file, or NULL */
+    off_t omapoff;		/* file offset of omap */
+    off_t opos;			/* file offset of next output byte */
+    struct sio *sio;		/* stdio thread (-I), or NULL */
+    uint64_t deadline;		/* when rel_timer is due (conn_now_ns) */
+    size_t tslot;			/* 1 + index in theap, or 0 */
+    char ready;			/* READY_* work queued on ready_list */
+    struct conn *rnext;		/* next on ready_list */
+    struct conn *dnext;		/* next on dead_list */
+
+    struct evsrc rsrc;		/* epoll registrations; wsrc unused */
+    struct evsrc wsrc;		/* when wfd == rfd */
+    struct evsrc nsrc;
 
     struct conn *next;		/* Linked list of connections */
     struct conn **prev;
 };
 
-static conn_t *conn_list;
-struct timespec last_timeout;
+static __thread conn_t *conn_list;
+
+/* Event handlers don't call rel_read and rel_output themselves: they
+ * flag the work and put the connection on ready_list, and conn_poll
+ * calls each at most once per connection after all events are in (so
+ * a batch of ACKs opening the window results in one rel_read).
+ * Destroyed connections wait on dead_list until their output is out.
+ * Neither walk touches connections with nothing to do. */
+#define READY_INPUT 1		/* call rel_read */
+#define READY_OUTPUT 2		/* call rel_output */
+static __thread conn_t *ready_list;
+static __thread conn_t *dead_list;
+
+/* Connections that asked for rel_timer (conn_timer), in a binary
+ * min-heap by deadline.  The loop sleeps until the first one is due,
+ * or indefinitely if there is none. */
+static __thread conn_t **theap;
+static __thread size_t theap_len;
+static __thread size_t theap_cap;
+
+/* The clock is read once per conn_poll iteration, after the wait, and
+ * everything handled in that round (timers, clock_now_ms) sees that
+ * time.  clock_source replaces CLOCK_MONOTONIC (clock_set_source). */
+static uint64_t (*clock_source) (void);
+static __thread uint64_t clock_ns;
+
+static void
+clock_update (void)
+{
+    struct timespec ts;
+
+    if (clock_source) {
+        clock_ns = clock_source ();
+        return;
+    }
+    clock_gettime (CLOCK_MONOTONIC, &ts);
+    clock_ns = (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static uint64_t
+conn_now_ns (void)
+{
+    if (!clock_ns)
+        clock_update ();	/* before the first conn_poll */
+    return clock_ns;
+}
+
+long
+clock_now_ms (void)
+{
+    return conn_now_ns () / 1000000;
+}
+
+void
+clock_set_source (uint64_t (*fn) (void))
+{
+    clock_source = fn;
+    clock_ns = 0;
+}
+
+static void
+theap_set (size_t i, conn_t *c)
+{
+    theap[i] = c;
+    c->tslot = i + 1;
+}
+
+static void
+theap_up (size_t i)
+{
+    conn_t *c = theap[i];
+
+    while (i > 0 && theap[(i - 1) / 2]->deadline > c->deadline) {
+        theap_set (i, theap[(i - 1) / 2]);
+        i = (i - 1) / 2;
+    }
+    theap_set (i, c);
+}
+
+static void
+theap_down (size_t i)
+{
+    conn_t *c = theap[i];
+    size_t k;
+
+    while ((k = 2 * i + 1) < theap_len) {
+        if (k + 1 < theap_len && theap[k + 1]->deadline < theap[k]->deadline)
+            k++;
+        if (theap[k]->deadline >= c->deadline)
+            break;
+        theap_set (i, theap[k]);
+        i = k;
+    }
+    theap_set (i, c);
+}
+
+static void
+theap_remove (conn_t *c)
+{
+    size_t i = c->tslot - 1;
+
+    if (!c->tslot)
+        return;
+    c->tslot = 0;
+    if (i == --theap_len)
+        return;
+    theap_set (i, theap[theap_len]);
+    if (i > 0 && theap[(i - 1) / 2]->deadline > theap[i]->deadline)
+        theap_up (i);
+    else
+        theap_down (i);
+}
+
+void
+conn_timer (conn_t *c, long ms)
+{
+    uint64_t when = conn_now_ns () + (uint64_t) (ms > 0 ? ms : 0) * 1000000;
+
+    if (c->delete_me)
+        return;
+    if (c->tslot) {
+        if (when < c->deadline) {
+            c->deadline = when;
+            theap_up (c->tslot - 1);
+        }
+        return;
+    }
+    if (theap_len == theap_cap) {
+        conn_t **h;
+        theap_cap = theap_cap ? 2 * theap_cap : 16;
+        h = xmalloc (theap_cap * sizeof (*h));
+        memcpy (h, theap, theap_len * sizeof (*h));
+        free (theap);
+        theap = h;
+    }
+    c->deadline = when;
+    theap_set (theap_len, c);
+    theap_up (theap_len++);
+}
+
+/* Milliseconds (rounded up) until the first timer is due; -1 if none,
+ * and 0 if there is work on ready_list.  Counted from the start of
+ * this round, so it errs on the late side by the time spent since. */
+static int
+conn_timer_wait (void)
+{
+    uint64_t now;
+
+    if (ready_list)
+        return 0;
+    if (!theap_len)
+        return -1;
+    now = conn_now_ns ();
+    if (theap[0]->deadline <= now)
+        return 0;
+    return (theap[0]->deadline - now + 999999) / 1000000;
+}
+
+static void
+conn_ready (conn_t *c, int what)
+{
+    if (c->delete_me)
+        return;
+    if (!c->ready) {
+        c->rnext = ready_list;
+        ready_list = c;
+    }
+    c->ready |= what;
+}
+
+/* Call rel_timer for the connections that are due.  Timers set again
+ * from rel_timer wait for the next round. */
+static void
+conn_run_timers (void)
+{
+    uint64_t now;
+    conn_t *c;
+
+    if (!theap_len)
+        return;
+    now = conn_now_ns ();
+    while (theap_len && theap[0]->deadline <= now) {
+        c = theap[0];
+        theap_remove (c);
+        conn_obuf_idle (c, now);
+#if HAVE_VMSPLICE
+        if (c->opinned)
+            conn_ready (c, READY_OUTPUT);	/* see conn_bufspace */
+#endif /* HAVE_VMSPLICE */
+        rel_timer (c->rel);
+    }
+}
+
+void
+conn_defer_read (conn_t *c)
+{
+    conn_ready (c, READY_INPUT);
+}
+
+void
+conn_defer_output (conn_t *c)
+{
+    conn_ready (c, READY_OUTPUT);
+}
+
+/* Do the work flagged while handling this round of events. */
+static void
+conn_run_ready (void)
+{
+    conn_t *c;
+    int what;
+
+    while ((c = ready_list)) {
+        ready_list = c->rnext;
+        what = c->ready;
+        c->ready = 0;
+        if ((what & READY_OUTPUT) && !c->delete_me)
+            rel_output (c->rel);
+        if ((what & READY_INPUT) && !c->delete_me)
+            rel_read (c->rel);
+    }
+}
+
+/* Server connections by peer address: open addressing with linear
+ * probing, at most half full, keyed by addrhash. */
+static __thread conn_t **peertab;
+static __thread size_t peertab_size;	/* 0 or a power of two */
+static __thread size_t peertab_used;
 
 #if !DMALLOC
 void *
@@ -115,6 +539,172 @@ clock_gettime (int id, struct timespec *tp)
 }
 #endif /* NEED_CLOCK_GETTIME */
 
+/* Input/output logging (-l) is written out by a background thread, so
+ * that a slow disk never stalls an event loop.  Each loop thread
+ * appends to a single-producer ring of its own per log; the writer
+ * drains all of them with large writes.  Whatever doesn't fit in a
+ * ring is dropped, and counted.  When all rings are empty the writer
+ * sleeps on log_cond, after setting log_waits and looking at the rings
+ * once more; appending wakes it only when it finds log_waits set. */
+#define LOGRING_SIZE (1 << 20)
+
+struct logring {
+    char *buf;
+    int fd;
+    uint64_t head;		/* bytes appended (producer) */
+    uint64_t tail;		/* bytes written out (writer thread) */
+    struct logring *next;
+};
+
+static struct logring *logrings;	/* only grows, at the front */
+static pthread_mutex_t logrings_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t log_cond = PTHREAD_COND_INITIALIZER;
+static pthread_t log_tid;
+static int log_stop;
+static int log_waits;		/* the writer is asleep, or about to be */
+static uint64_t log_dropped;
+static __thread struct logring *log_ring[2];	/* log_in, log_out */
+
+static struct logring *
+log_ring_new (int fd)
+{
+    struct logring *lr = xmalloc (sizeof (*lr));
+    lr->buf = xmalloc (LOGRING_SIZE);
+    lr->fd = fd;
+    lr->head = lr->tail = 0;
+    pthread_mutex_lock (&logrings_lock);
+    lr->next = logrings;
+    __atomic_store_n (&logrings, lr, __ATOMIC_RELEASE);
+    pthread_mutex_unlock (&logrings_lock);
+    return lr;
+}
+
+/* Wake the writer thread. */
+static void
+log_wake (void)
+{
+    pthread_mutex_lock (&logrings_lock);
+    pthread_cond_signal (&log_cond);
+    pthread_mutex_unlock (&logrings_lock);
+}
+
+/* Append n bytes to this thread's ring for log_in (out == 0) or
+ * log_out (out == 1).  Never blocks. */
+static void
+log_append (int out, const void *buf, size_t n)
+{
+    struct logring *lr = log_ring[out];
+    uint64_t head;
+    size_t at, first;
+
+    if (!lr)
+        lr = log_ring[out] = log_ring_new (out ? log_out : log_in);
+    head = lr->head;
+    if (LOGRING_SIZE - (head - __atomic_load_n (&lr->tail, __ATOMIC_ACQUIRE))
+            < n) {
+        __atomic_fetch_add (&log_dropped, n, __ATOMIC_RELAXED);
+        return;
+    }
+    at = head % LOGRING_SIZE;
+    first = LOGRING_SIZE - at < n ? LOGRING_SIZE - at : n;
+    memcpy (lr->buf + at, buf, first);
+    memcpy (lr->buf, (const char *) buf + first, n - first);
+    __atomic_store_n (&lr->head, head + n, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n (&log_waits, __ATOMIC_SEQ_CST)
+            && __atomic_exchange_n (&log_waits, 0, __ATOMIC_SEQ_CST))
+        log_wake ();
+}
+
+static void *
+log_writer (void *arg)
+{
+    int armed = 0;
+    (void) arg;
+
+    for (;;) {
+        int stop = __atomic_load_n (&log_stop, __ATOMIC_SEQ_CST);
+        int busy = 0;
+        struct logring *lr;
+
+        for (lr = __atomic_load_n (&logrings, __ATOMIC_ACQUIRE); lr;
+                lr = lr->next) {
+            uint64_t head = __atomic_load_n (&lr->head, __ATOMIC_SEQ_CST);
+            size_t n = head - lr->tail, at = lr->tail % LOGRING_SIZE;
+            struct iovec iov[2];
+            ssize_t w;
+
+            if (!n)
+                continue;
+            busy = 1;
+            iov[0].iov_base = lr->buf + at;
+            iov[0].iov_len = LOGRING_SIZE - at < n ? LOGRING_SIZE - at : n;
+            iov[1].iov_base = lr->buf;
+            iov[1].iov_len = n - iov[0].iov_len;
+            w = writev (lr->fd, iov, iov[1].iov_len ? 2 : 1);
+            if (w < 0) {
+                if (errno == EINTR)
+                    continue;
+                /* Give up on this chunk rather than spin on a bad log. */
+                __atomic_fetch_add (&log_dropped, n, __ATOMIC_RELAXED);
+                w = n;
+            }
+            __atomic_store_n (&lr->tail, lr->tail + w, __ATOMIC_RELEASE);
+        }
+        if (busy) {
+            armed = 0;
+            continue;
+        }
+        if (stop)
+            break;
+        /* Ask to be woken, then look once more before sleeping. */
+        if (!armed) {
+            __atomic_store_n (&log_waits, 1, __ATOMIC_SEQ_CST);
+            armed = 1;
+            continue;
+        }
+        pthread_mutex_lock (&logrings_lock);
+        while (__atomic_load_n (&log_waits, __ATOMIC_SEQ_CST)
+                && !__atomic_load_n (&log_stop, __ATOMIC_SEQ_CST))
+            pthread_cond_wait (&log_cond, &logrings_lock);
+        pthread_mutex_unlock (&logrings_lock);
+        armed = 0;
+    }
+    return NULL;
+}
+
+/* At exit: write out what is left, and report what was dropped. */
+static void
+log_finish (void)
+{
+    __atomic_store_n (&log_stop, 1, __ATOMIC_SEQ_CST);
+    log_wake ();
+    pthread_join (log_tid, NULL);
+    if (log_dropped)
+        fprintf (stderr, "%s: %llu bytes dropped from the -l logs\n",
+                 progname, (unsigned long long) log_dropped);
+}
+
+static void
+log_start (void)
+{
+    if ((errno = pthread_create (&log_tid, NULL, log_writer, NULL))) {
+        perror ("pthread_create");
+        exit (1);
+    }
+    atexit (log_finish);
+}
+
+/* The window of a 10-byte ACK (network byte order). */
+static uint16_t
+ack_window (const packet_t *buf)
+{
+    uint16_t w;
+
+    memcpy (&w, (const char *) buf + offsetof (struct ack_wnd_packet, window),
+            sizeof (w));
+    return w;
+}
+
 void
 print_pkt (const packet_t *buf, const char *op, int n)
 {
@@ -129,6 +719,11 @@ print_pkt (const packet_t *buf, const char *op, int n)
     else if (n == 8)
         fprintf (stderr, "%5d %s(%3d): cksum = %04x, len = %04x, ack = %08x\n",
                     pid, op, n, buf->cksum, ntohs (buf->len), ntohl (buf->ackno));
+    else if (n == 10)
+        fprintf (stderr,
+                "%5d %s(%3d): cksum = %04x, len = %04x, ack = %08x, wnd = %u\n",
+                pid, op, n, buf->cksum, ntohs (buf->len), ntohl (buf->ackno),
+                ntohs (ack_window (buf)));
     else if (n >= 12)
         fprintf (stderr,
                 "%5d %s(%3d): cksum = %04x, len = %04x, ack = %08x, seq = %08x\n",
@@ -139,49 +734,1538 @@ print_pkt (const packet_t *buf, const char *op, int n)
     errno = saved_errno;
 }
 
-int
-conn_sendpkt (conn_t *c, const packet_t *pkt, size_t len)
+#if HAVE_EPOLL
+static void
+ev_add (struct evsrc *e, conn_t *c, int fd, int events)
+{
+    struct epoll_event ev;
+
+    e->c = c;
+    e->fd = fd;
+    e->events = events;
+    ev.events = events;
+    ev.data.ptr = e;
+    if (epoll_ctl (epfd, EPOLL_CTL_ADD, fd, &ev) == 0)
+        e->added = 1;
+    else if (errno == EPERM) {
+        /* Regular files and the like can't be polled; like poll(),
+         * treat them as always ready. */
+        e->always = 1;
+        e->anext = evalways;
+        evalways = e;
+    }
+    else
+        perror ("epoll_ctl");
+}
+
+static void
+ev_set (struct evsrc *e, int events)
+{
+    struct epoll_event ev;
+
+    if (e->events == events)
+        return;
+    e->events = events;
+    if (!e->added)
+        return;
+    ev.events = events;
+    ev.data.ptr = e;
+    if (epoll_ctl (epfd, EPOLL_CTL_MOD, e->fd, &ev) < 0)
+        perror ("epoll_ctl");
+}
+
+static void
+ev_del (struct evsrc *e)
+{
+    struct evsrc **ep;
+
+    if (e->added)
+        epoll_ctl (epfd, EPOLL_CTL_DEL, e->fd, NULL);
+    if (e->always)
+        for (ep = &evalways; *ep; ep = &(*ep)->anext)
+            if (*ep == e) {
+                *ep = e->anext;
+                break;
+            }
+    e->added = e->always = 0;
+    e->events = 0;
+}
+#endif /* HAVE_EPOLL */
+
+/* Report a dead peer (ICMP port unreachable) and tear down the connection. */
+static void
+conn_peer_dead (conn_t *c, const struct config_common *cc)
+{
+    char addr[NI_MAXHOST] = "unknown";
+    char port[NI_MAXSERV] = "unknown";
+    getnameinfo ((const struct sockaddr *) &c->peer, sizeof (c->peer),
+    addr, sizeof (addr), port, sizeof (port),
+    NI_DGRAM | NI_NUMERICHOST|NI_NUMERICSERV);
+    fprintf (stderr, "[received ICMP port unreachable;"
+    " assuming peer at %s:%s is dead]\n", addr, port);
+    if (cc->single_connection)
+    exit (1);
+    rel_destroy (c->rel);
+}
+
+#if HAVE_IO_URING
+/* Optional io_uring backend for the network side (-U).  UDP sends are
+ * copied into registered buffer slots and queued; receives are kept
+ * posted on each client connection's socket.  Everything queued during
+ * one conn_poll iteration goes to the kernel in a single io_uring_enter,
+ * and completions are reaped when the ring's fd polls readable.  Input
+ * and output descriptors stay on the readiness path, since conn_input
+ * and conn_output must complete synchronously. */
+#define URING_ENTRIES 1024
+#define URING_SEND_SLOTS 512
+#define URING_RECV_SLOTS 64
+#define URING_RECV_PER_CONN 16
+#define URING_CANCEL ((__u64) -1)
+
+struct uring {
+    int fd;
+    unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+    unsigned *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+    unsigned pending;		/* SQEs prepared but not yet submitted */
+    int fixed;			/* bufs registered with the kernel */
+    packet_t *bufs;		/* send slots, then receive slots */
+    int send_free;		/* free list of send slots */
+    int send_busy;		/* send slots the kernel still has */
+    int send_next[URING_SEND_SLOTS];
+    conn_t *recv_owner[URING_RECV_SLOTS];	/* NULL once cancelled */
+    char recv_busy[URING_RECV_SLOTS];
+};
+
+static __thread struct uring uring = { .fd = -1 };
+static __thread struct evsrc uring_src;
+
+static int
+uring_init (void)
+{
+    struct io_uring_params p;
+    struct iovec iov;
+    size_t sqsize, cqsize;
+    char *sq, *cq;
+    int i;
+
+    memset (&p, 0, sizeof (p));
+    uring.fd = syscall (__NR_io_uring_setup, URING_ENTRIES, &p);
+    if (uring.fd < 0) {
+        perror ("io_uring_setup");
+        return -1;
+    }
+
+    sqsize = p.sq_off.array + p.sq_entries * sizeof (unsigned);
+    cqsize = p.cq_off.cqes + p.cq_entries * sizeof (struct io_uring_cqe);
+    if ((p.features & IORING_FEAT_SINGLE_MMAP) && cqsize > sqsize)
+        sqsize = cqsize;
+    sq = mmap (NULL, sqsize, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE,
+               uring.fd, IORING_OFF_SQ_RING);
+    if (sq == MAP_FAILED)
+        goto fail;
+    if (p.features & IORING_FEAT_SINGLE_MMAP)
+        cq = sq;
+    else {
+        cq = mmap (NULL, cqsize, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE,
+                   uring.fd, IORING_OFF_CQ_RING);
+        if (cq == MAP_FAILED)
+            goto fail;
+    }
+    uring.sqes = mmap (NULL, p.sq_entries * sizeof (struct io_uring_sqe),
+                       PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE,
+                       uring.fd, IORING_OFF_SQES);
+    if (uring.sqes == MAP_FAILED)
+        goto fail;
+
+    uring.sq_head = (unsigned *) (sq + p.sq_off.head);
+    uring.sq_tail = (unsigned *) (sq + p.sq_off.tail);
+    uring.sq_mask = (unsigned *) (sq + p.sq_off.ring_mask);
+    uring.sq_array = (unsigned *) (sq + p.sq_off.array);
+    uring.cq_head = (unsigned *) (cq + p.cq_off.head);
+    uring.cq_tail = (unsigned *) (cq + p.cq_off.tail);
+    uring.cq_mask = (unsigned *) (cq + p.cq_off.ring_mask);
+    uring.cqes = (struct io_uring_cqe *) (cq + p.cq_off.cqes);
+
+    uring.bufs = xmalloc ((URING_SEND_SLOTS + URING_RECV_SLOTS)
+                          * sizeof (packet_t));
+    iov.iov_base = uring.bufs;
+    iov.iov_len = (URING_SEND_SLOTS + URING_RECV_SLOTS) * sizeof (packet_t);
+    /* Without registered buffers (e.g., RLIMIT_MEMLOCK), fall back to
+     * plain reads and writes through the ring. */
+    uring.fixed = syscall (__NR_io_uring_register, uring.fd,
+                           IORING_REGISTER_BUFFERS, &iov, 1) == 0;
+
+    for (i = 0; i < URING_SEND_SLOTS; i++)
+        uring.send_next[i] = i + 1 < URING_SEND_SLOTS ? i + 1 : -1;
+    uring.send_free = 0;
+    return 0;
+
+ fail:
+    perror ("io_uring mmap");
+    close (uring.fd);
+    uring.fd = -1;
+    return -1;
+}
+
+/* Hand everything queued so far to the kernel, optionally waiting
+ * for at least one completion.  Returns -1 on errors other than
+ * interruptions and a full completion queue. */
+static int
+uring_submit (unsigned wait)
 {
     int n;
-    assert (!c->delete_me);
-    if (c->server)
-        n = sendto (c->nfd, pkt, len, 0,
-                    (const struct sockaddr *) &c->peer, addrsize (&c->peer));
+
+    if (!uring.pending && !wait)
+        return 0;
+    n = syscall (__NR_io_uring_enter, uring.fd, uring.pending, wait,
+                 wait ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+    if (n < 0) {
+        if (errno != EINTR && errno != EAGAIN && errno != EBUSY) {
+            perror ("io_uring_enter");
+            return -1;
+        }
+        return 0;
+    }
+    uring.pending -= n;
+    return 0;
+}
+
+static struct io_uring_sqe *
+uring_sqe (void)
+{
+    unsigned tail = *uring.sq_tail;
+    struct io_uring_sqe *sqe;
+
+    if (tail - __atomic_load_n (uring.sq_head, __ATOMIC_ACQUIRE)
+            >= URING_ENTRIES) {
+        uring_submit (0);
+        if (tail - __atomic_load_n (uring.sq_head, __ATOMIC_ACQUIRE)
+                >= URING_ENTRIES)
+            return NULL;
+    }
+    sqe = &uring.sqes[tail & *uring.sq_mask];
+    memset (sqe, 0, sizeof (*sqe));
+    uring.sq_array[tail & *uring.sq_mask] = tail & *uring.sq_mask;
+    return sqe;
+}
+
+static void
+uring_push (void)
+{
+    __atomic_store_n (uring.sq_tail, *uring.sq_tail + 1, __ATOMIC_RELEASE);
+    uring.pending++;
+}
+
+static void
+uring_prep_rw (struct io_uring_sqe *sqe, int write, int fd,
+               packet_t *buf, size_t len, __u64 tag)
+{
+    if (uring.fixed)
+        sqe->opcode = write ? IORING_OP_WRITE_FIXED : IORING_OP_READ_FIXED;
     else
-        n = send (c->nfd, pkt, len, 0);
-    if (opt_debug)
-        print_pkt (pkt, "send", n);
-    return n;
+        sqe->opcode = write ? IORING_OP_WRITE : IORING_OP_READ;
+    sqe->fd = fd;
+    sqe->addr = (unsigned long) buf;
+    sqe->len = len;
+    sqe->buf_index = 0;
+    sqe->user_data = tag;
 }
 
-size_t
-conn_bufspace (conn_t *c)
+/* Queue a send on a connected socket.  Returns -1 if out of slots. */
+static int
+uring_send (conn_t *c, const packet_t *pkt, size_t len)
+{
+    struct io_uring_sqe *sqe;
+    int slot = uring.send_free;
+
+    if (slot < 0 || len > sizeof (packet_t) || !(sqe = uring_sqe ()))
+        return -1;
+    uring.send_free = uring.send_next[slot];
+    uring.send_busy++;
+    memcpy (&uring.bufs[slot], pkt, len);
+    uring_prep_rw (sqe, 1, c->nfd, &uring.bufs[slot], len, slot);
+    uring_push ();
+    return len;
+}
+
+static void
+uring_post_recv (conn_t *c, int slot)
+{
+    struct io_uring_sqe *sqe = uring_sqe ();
+
+    if (!sqe)
+        return;
+    uring.recv_owner[slot] = c;
+    uring.recv_busy[slot] = 1;
+    uring_prep_rw (sqe, 0, c->nfd, &uring.bufs[URING_SEND_SLOTS + slot],
+                   sizeof (packet_t), URING_SEND_SLOTS + slot);
+    uring_push ();
+}
+
+/* Keep receives posted on a client connection's socket. */
+static void
+uring_attach (conn_t *c)
+{
+    int i, n = 0;
+
+    for (i = 0; i < URING_RECV_SLOTS && n < URING_RECV_PER_CONN; i++)
+        if (!uring.recv_busy[i]) {
+            uring_post_recv (c, i);
+            n++;
+        }
+}
+
+static void
+uring_detach (conn_t *c)
+{
+    struct io_uring_sqe *sqe;
+    int i;
+
+    for (i = 0; i < URING_RECV_SLOTS; i++)
+        if (uring.recv_owner[i] == c) {
+            uring.recv_owner[i] = NULL;
+            if ((sqe = uring_sqe ())) {
+                sqe->opcode = IORING_OP_ASYNC_CANCEL;
+                sqe->fd = -1;
+                sqe->addr = URING_SEND_SLOTS + i;
+                sqe->user_data = URING_CANCEL;
+                uring_push ();
+            }
+        }
+    /* The socket is about to be closed; make sure the kernel has seen
+     * the cancellations first. */
+    uring_submit (0);
+}
+
+static void
+uring_reap (const struct config_common *cc)
 {
-    chunk_t *ch;
-    size_t used = 0;
-    const size_t bufsize = 8192;
+    unsigned head = *uring.cq_head;
+
+    while (head != __atomic_load_n (uring.cq_tail, __ATOMIC_ACQUIRE)) {
+        struct io_uring_cqe *cqe = &uring.cqes[head & *uring.cq_mask];
+        __u64 tag = cqe->user_data;
+        int res = cqe->res;
+
+        head++;
+        __atomic_store_n (uring.cq_head, head, __ATOMIC_RELEASE);
+
+        if (tag == URING_CANCEL)
+            continue;
+        if (tag < URING_SEND_SLOTS) {
+            if (res < 0 && opt_debug) {
+                errno = -res;
+                print_pkt (&uring.bufs[tag], "send", -1);
+            }
+            uring.send_next[tag] = uring.send_free;
+            uring.send_free = tag;
+            uring.send_busy--;
+        }
+        else {
+            int slot = tag - URING_SEND_SLOTS;
+            conn_t *c = uring.recv_owner[slot];
+            packet_t *pkt = &uring.bufs[tag];
+
+            uring.recv_busy[slot] = 0;
+            uring.recv_owner[slot] = NULL;
+            if (!c || c->delete_me)
+                continue;
+            if (res == -ECONNREFUSED) {
+                conn_peer_dead (c, cc);
+                continue;
+            }
+            if (res < 0) {
+                if (res != -EAGAIN && res != -EINTR) {
+                    errno = -res;
+                    perror ("recv");
+                }
+            }
+            else {
+                if (opt_debug)
+                    print_pkt (pkt, "recv", res);
+                rel_recvpkt (c->rel, pkt, res);
+                memset (pkt, 0xc9, res); /* for debugging */
+            }
+            if (!c->delete_me)
+                uring_post_recv (c, slot);
+        }
+    }
+}
 
+/* Wait until the kernel is done with every send queued so far: the
+ * last ACKs of a connection are often still in the ring when it is
+ * freed, and would be lost with its socket (or the process). */
+static void
+uring_drain (const struct config_common *cc)
+{
+    while (uring.send_busy) {
+        if (uring_submit (1) < 0)
+            break;
+        uring_reap (cc);
+    }
+}
+#endif /* HAVE_IO_URING */
 
-    for (ch = c->outq; ch; ch = ch->next)
-        used += (ch->size - ch->used);
-    return used > bufsize ? 0 : bufsize - used;
+/* Turn interest in input (rfd readable) on or off. */
+static void
+conn_rwant (conn_t *c, int on)
+{
+    if (c->sio)
+        return;			/* the stdio thread reads rfd */
+#if HAVE_EPOLL
+    if (epfd >= 0) {
+        ev_set (&c->rsrc, on ? c->rsrc.events | POLLIN
+                             : c->rsrc.events & ~POLLIN);
+        return;
+    }
+#endif /* HAVE_EPOLL */
+    if (!c->rpoll)
+        return;
+    if (on)
+        cevents[c->rpoll].events |= POLLIN;
+    else
+        cevents[c->rpoll].events &= ~POLLIN;
+}
+
+/* Turn interest in output space (wfd writable) on or off. */
+static void
+conn_wwant (conn_t *c, int on)
+{
+    if (c->sio)
+        return;
+#if HAVE_EPOLL
+    if (epfd >= 0) {
+        struct evsrc *e = c->wfd == c->rfd ? &c->rsrc : &c->wsrc;
+        ev_set (e, on ? e->events | POLLOUT : e->events & ~POLLOUT);
+        return;
+    }
+#endif /* HAVE_EPOLL */
+    if (!c->wpoll)
+        return;
+    if (on)
+        cevents[c->wpoll].events |= POLLOUT;
+    else
+        cevents[c->wpoll].events &= ~POLLOUT;
+}
+
+/* What the loop watches for a client connection's datagrams: the
+ * socket, or with -p, the receive ring. */
+static int
+conn_netfd (conn_t *c)
+{
+#if HAVE_PIPELINE
+    if (npipe && !c->server)
+        return npipe->rx.cfd;
+#endif /* HAVE_PIPELINE */
+    return c->nfd;
+}
+
+static int
+uring_active (void)
+{
+#if HAVE_IO_URING
+    return uring.fd >= 0;
+#else /* !HAVE_IO_URING */
+    return 0;
+#endif /* !HAVE_IO_URING */
+}
+
+/* Start watching a connection's descriptors, once they are set up. */
+static void
+conn_register (conn_t *c)
+{
+#if HAVE_EPOLL
+    if (epfd >= 0) {
+        int wev = c->olen ? POLLOUT : 0;
+#if HAVE_PIPELINE
+        if (c->sio)
+            ev_add (&c->rsrc, c, c->sio->in.cfd, POLLIN);
+        else
+#endif /* HAVE_PIPELINE */
+        {
+            ev_add (&c->rsrc, c, c->rfd, (c->xoff ? 0 : POLLIN)
+                    | (c->wfd == c->rfd ? wev : 0));
+            if (c->wfd != c->rfd)
+                ev_add (&c->wsrc, c, c->wfd, wev);
+        }
+        if (!c->server && !uring_active ())
+            ev_add (&c->nsrc, c, conn_netfd (c), POLLIN);
+    }
+    else
+#endif /* HAVE_EPOLL */
+        cevents_generation++;
+#if HAVE_IO_URING
+    if (!c->server && uring_active ())
+        uring_attach (c);
+#endif /* HAVE_IO_URING */
+}
+
+static void
+conn_unregister (conn_t *c)
+{
+#if HAVE_IO_URING
+    if (!c->server && uring_active ())
+        uring_detach (c);
+#endif /* HAVE_IO_URING */
+#if HAVE_EPOLL
+    if (epfd >= 0) {
+        ev_del (&c->rsrc);
+        if (c->wfd != c->rfd)
+            ev_del (&c->wsrc);
+        if (!c->server)
+            ev_del (&c->nsrc);
+        return;
+    }
+#endif /* HAVE_EPOLL */
+    cevents_generation++;
+}
+
+#if HAVE_MMSG
+#if HAVE_UDP_GSO
+/* Can queue entry b be sent in the same GSO datagram as the run that
+ * starts at a (and currently ends with prev)?  All segments but the
+ * last must have the same size. */
+static int
+gso_joinable (const struct sendq_ent *a, const struct sendq_ent *prev,
+              const struct sendq_ent *b)
+{
+    return __atomic_load_n (&opt_gso, __ATOMIC_RELAXED)
+        && b->fd == a->fd && b->namelen == a->namelen
+        && prev->len == a->len && b->len <= a->len
+        && (!a->namelen || !memcmp (&a->name, &b->name, a->namelen));
+}
+#endif /* HAVE_UDP_GSO */
+
+static void
+sendq_flush (void)
+{
+    struct mmsghdr msgs[SENDQ_MAX];
+    struct iovec iov[SENDQ_MAX];
+    int first[SENDQ_MAX + 1];	/* first queue entry of each message */
+#if HAVE_UDP_GSO
+    union {
+        char buf[CMSG_SPACE (sizeof (uint16_t))];
+        struct cmsghdr align;
+    } ctl[SENDQ_MAX];
+#endif /* HAVE_UDP_GSO */
+    int i, j, k, m, n, nmsgs = 0;
+
+    for (i = 0; i < nsendq; i = j) {
+        struct msghdr *h = &msgs[nmsgs].msg_hdr;
+
+        j = i + 1;
+#if HAVE_UDP_GSO
+        while (j < nsendq && j - i < GSO_MAX_SEGS
+               && gso_joinable (&sendq[i], &sendq[j - 1], &sendq[j]))
+            j++;
+#endif /* HAVE_UDP_GSO */
+        for (k = i; k < j; k++) {
+            iov[k].iov_base = &sendq[k].pkt;
+            iov[k].iov_len = sendq[k].len;
+        }
+        memset (&msgs[nmsgs], 0, sizeof (msgs[nmsgs]));
+        h->msg_iov = &iov[i];
+        h->msg_iovlen = j - i;
+        if (sendq[i].namelen) {
+            h->msg_name = &sendq[i].name;
+            h->msg_namelen = sendq[i].namelen;
+        }
+#if HAVE_UDP_GSO
+        if (j - i > 1) {
+            struct cmsghdr *cm;
+            h->msg_control = ctl[nmsgs].buf;
+            h->msg_controllen = sizeof (ctl[nmsgs].buf);
+            cm = CMSG_FIRSTHDR (h);
+            cm->cmsg_level = SOL_UDP;
+            cm->cmsg_type = UDP_SEGMENT;
+            cm->cmsg_len = CMSG_LEN (sizeof (uint16_t));
+            *(uint16_t *) CMSG_DATA (cm) = sendq[i].len;
+        }
+#endif /* HAVE_UDP_GSO */
+        first[nmsgs++] = i;
+    }
+    first[nmsgs] = nsendq;
+
+    /* One sendmmsg per run of messages on the same socket; a failed
+     * packet (e.g., ECONNREFUSED) is skipped, just as send() would. */
+    for (k = 0; k < nmsgs; k = m) {
+        for (m = k + 1; m < nmsgs && sendq[first[m]].fd == sendq[first[k]].fd;
+             m++)
+            ;
+        while (k < m) {
+            n = sendmmsg (sendq[first[k]].fd, &msgs[k], m - k, MSG_DONTWAIT);
+            if (n <= 0) {
+#if HAVE_UDP_GSO
+                if (msgs[k].msg_hdr.msg_iovlen > 1
+                        && (errno == EIO || errno == EINVAL)) {
+                    /* No segmentation offload on this path after all */
+                    fprintf (stderr, "%s: UDP GSO failed (%s), disabled\n",
+                             progname, strerror (errno));
+                    __atomic_store_n (&opt_gso, 0, __ATOMIC_RELAXED);
+                    for (i = first[k]; i < first[k + 1]; i++) {
+                        n = sendto (sendq[i].fd, &sendq[i].pkt, sendq[i].len,
+                                    MSG_DONTWAIT, msgs[k].msg_hdr.msg_name,
+                                    msgs[k].msg_hdr.msg_namelen);
+                        if (opt_debug)
+                            print_pkt (&sendq[i].pkt, "send", n);
+                    }
+                    k++;
+                    continue;
+                }
+#endif /* HAVE_UDP_GSO */
+                if (opt_debug)
+                    for (i = first[k]; i < first[k + 1]; i++)
+                        print_pkt (&sendq[i].pkt, "send", -1);
+                k++;
+                continue;
+            }
+            if (opt_debug)
+                for (i = first[k]; i < first[k + n]; i++)
+                    print_pkt (&sendq[i].pkt, "send", sendq[i].len);
+            k += n;
+        }
+    }
+    nsendq = 0;
+}
+
+/* Queue a packet for sendq_flush; to is NULL on connected sockets. */
+static void
+sendq_push (int fd, const struct sockaddr_storage *to, const packet_t *pkt,
+            size_t len)
+{
+    struct sendq_ent *q;
+
+    if (nsendq == SENDQ_MAX)
+        sendq_flush ();
+    q = &sendq[nsendq++];
+    q->fd = fd;
+    q->namelen = 0;
+    if (to) {
+        q->namelen = addrsize (to);
+        memcpy (&q->name, to, q->namelen);
+    }
+    q->len = len;
+    memcpy (&q->pkt, pkt, len);
+}
+#endif /* HAVE_MMSG */
+
+#if HAVE_PIPELINE
+static int
+efd_new (void)
+{
+    int fd = eventfd (0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (fd < 0) {
+        perror ("eventfd");
+        exit (1);
+    }
+    return fd;
+}
+
+static void
+efd_signal (int fd)
+{
+    uint64_t one = 1;
+    if (write (fd, &one, sizeof (one)) < 0 && errno != EAGAIN)
+        perror ("eventfd");
+}
+
+static void
+efd_clear (int fd)
+{
+    uint64_t n;
+    if (read (fd, &n, sizeof (n)) < 0 && errno != EAGAIN)
+        perror ("eventfd");
+}
+
+static void
+spsc_init (struct spsc *q, int cfd, int pfd)
+{
+    memset (q, 0, sizeof (*q));
+    q->cfd = cfd;
+    q->pfd = pfd;
+}
+
+/* Signal fd if the other side said it was going to sleep. */
+static void
+spsc_wake (int *waits, int fd)
+{
+    if (__atomic_load_n (waits, __ATOMIC_SEQ_CST)
+            && __atomic_exchange_n (waits, 0, __ATOMIC_SEQ_CST))
+        efd_signal (fd);
+}
+
+/* Producer: everything before head is filled in. */
+static void
+spsc_publish (struct spsc *q, uint64_t head)
+{
+    __atomic_store_n (&q->head, head, __ATOMIC_SEQ_CST);
+    spsc_wake (&q->cwaits, q->cfd);
+}
+
+/* Consumer: everything before tail may be reused. */
+static void
+spsc_release (struct spsc *q, uint64_t tail)
+{
+    __atomic_store_n (&q->tail, tail, __ATOMIC_SEQ_CST);
+    spsc_wake (&q->pwaits, q->pfd);
+}
+
+/* Consumer found the ring empty at tail: ask to be woken, and return
+ * what has arrived in the meantime (if anything, no wakeup is due). */
+static uint64_t
+spsc_carm (struct spsc *q, uint64_t tail)
+{
+    uint64_t n;
+
+    __atomic_store_n (&q->cwaits, 1, __ATOMIC_SEQ_CST);
+    if ((n = __atomic_load_n (&q->head, __ATOMIC_SEQ_CST) - tail))
+        __atomic_store_n (&q->cwaits, 0, __ATOMIC_RELAXED);
+    return n;
+}
+
+/* Producer found the ring (of size slots) full at head: likewise. */
+static uint64_t
+spsc_parm (struct spsc *q, uint64_t head, uint64_t size)
+{
+    uint64_t n;
+
+    __atomic_store_n (&q->pwaits, 1, __ATOMIC_SEQ_CST);
+    if ((n = size - (head - __atomic_load_n (&q->tail, __ATOMIC_SEQ_CST))))
+        __atomic_store_n (&q->pwaits, 0, __ATOMIC_RELAXED);
+    return n;
+}
+
+/* RX thread: recvmmsg straight into free slots of the receive ring. */
+static void *
+netpipe_rx (void *arg)
+{
+    struct netpipe *p = arg;
+    struct mmsghdr msgs[RECV_BATCH];
+    struct iovec iov[RECV_BATCH];
+    struct pollfd pfd[2];
+    uint64_t head = 0, room;
+    int i, k, n;
+
+    pfd[1].fd = p->rx.pfd;
+    pfd[1].events = POLLIN;
+    while (!__atomic_load_n (&p->stop, __ATOMIC_ACQUIRE)) {
+        room = PIPE_SLOTS
+            - (head - __atomic_load_n (&p->rx.tail, __ATOMIC_ACQUIRE));
+        if (!room)
+            room = spsc_parm (&p->rx, head, PIPE_SLOTS);
+        if (room) {
+            size_t at = head % PIPE_SLOTS;
+            k = room < RECV_BATCH ? room : RECV_BATCH;
+            if (k > PIPE_SLOTS - at)
+                k = PIPE_SLOTS - at;
+            for (i = 0; i < k; i++) {
+                iov[i].iov_base = &p->rxslots[at + i].pkt;
+                iov[i].iov_len = sizeof (packet_t);
+                memset (&msgs[i], 0, sizeof (msgs[i]));
+                msgs[i].msg_hdr.msg_iov = &iov[i];
+                msgs[i].msg_hdr.msg_iovlen = 1;
+            }
+            n = recvmmsg (p->nfd, msgs, k, MSG_DONTWAIT, NULL);
+            if (n > 0) {
+                for (i = 0; i < n; i++) {
+                    p->rxslots[at + i].len = msgs[i].msg_len;
+                    if (opt_debug)
+                        print_pkt (&p->rxslots[at + i].pkt, "recv",
+                                   msgs[i].msg_len);
+                }
+                head += n;
+                spsc_publish (&p->rx, head);
+                continue;
+            }
+            if (n < 0 && errno == ECONNREFUSED) {
+                /* Pass the ICMP error on, and stop. */
+                p->rxslots[at].len = -1;
+                spsc_publish (&p->rx, head + 1);
+                break;
+            }
+            if (n < 0 && errno != EAGAIN && errno != EINTR)
+                perror ("recv");
+        }
+        /* Wait for datagrams, or (with the ring full) for room. */
+        pfd[0].fd = room ? p->nfd : -1;
+        pfd[0].events = POLLIN;
+        if (poll (pfd, 2, -1) > 0 && pfd[1].revents)
+            efd_clear (p->rx.pfd);
+    }
+    return NULL;
+}
+
+/* TX thread: sendmmsg whatever the loop handed over, in batches.  The
+ * slots are released only once sent, so that an empty ring means all
+ * sent (see netpipe_stop). */
+static void *
+netpipe_tx (void *arg)
+{
+    struct netpipe *p = arg;
+    struct pollfd pfd;
+    uint64_t tail = 0, n;
+
+    pfd.fd = p->tx.cfd;
+    pfd.events = POLLIN;
+    for (;;) {
+        n = __atomic_load_n (&p->tx.head, __ATOMIC_ACQUIRE) - tail;
+        if (!n && !(n = spsc_carm (&p->tx, tail))) {
+            if (__atomic_load_n (&p->stop, __ATOMIC_ACQUIRE))
+                break;
+            if (poll (&pfd, 1, -1) > 0)
+                efd_clear (p->tx.cfd);
+            continue;
+        }
+        while (n--) {
+            struct pktslot *s = &p->txslots[tail++ % PIPE_SLOTS];
+            sendq_push (p->nfd, NULL, &s->pkt, s->len);
+            if (nsendq == SENDQ_MAX) {
+                sendq_flush ();
+                spsc_release (&p->tx, tail);
+            }
+        }
+        if (nsendq)
+            sendq_flush ();
+        spsc_release (&p->tx, tail);
+    }
+    return NULL;
+}
+
+static void
+netpipe_start (int nfd)
+{
+    struct netpipe *p = xmalloc (sizeof (*p));
+
+    memset (p, 0, sizeof (*p));
+    p->nfd = nfd;
+    spsc_init (&p->rx, efd_new (), efd_new ());
+    spsc_init (&p->tx, efd_new (), efd_new ());
+    p->rx.cwaits = 1;		/* the loop waits for the eventfd from the start */
+    p->rxslots = xmalloc (PIPE_SLOTS * sizeof (struct pktslot));
+    p->txslots = xmalloc (PIPE_SLOTS * sizeof (struct pktslot));
+    if ((errno = pthread_create (&p->rxtid, NULL, netpipe_rx, p))
+            || (errno = pthread_create (&p->txtid, NULL, netpipe_tx, p))) {
+        perror ("pthread_create");
+        exit (1);
+    }
+    npipe = p;
+}
+
+/* Send what is still queued, then shut both threads down. */
+static void
+netpipe_stop (void)
+{
+    struct netpipe *p = npipe;
+
+    spsc_publish (&p->tx, p->txhead);
+    __atomic_store_n (&p->stop, 1, __ATOMIC_SEQ_CST);
+    efd_signal (p->tx.cfd);
+    efd_signal (p->rx.pfd);
+    pthread_join (p->txtid, NULL);
+    pthread_join (p->rxtid, NULL);
+    close (p->rx.cfd);
+    close (p->rx.pfd);
+    close (p->tx.cfd);
+    close (p->tx.pfd);
+    free (p->rxslots);
+    free (p->txslots);
+    free (p);
+    npipe = NULL;
+}
+
+/* conn_sendpkt with -p: fill a slot of the send ring, waiting for the
+ * TX thread if the ring is full. */
+static int
+netpipe_send (const packet_t *pkt, size_t len)
+{
+    struct netpipe *p = npipe;
+    struct pktslot *s;
+    struct pollfd pfd;
+
+    while (p->txhead - __atomic_load_n (&p->tx.tail, __ATOMIC_ACQUIRE)
+           == PIPE_SLOTS) {
+        spsc_publish (&p->tx, p->txhead);
+        if (!spsc_parm (&p->tx, p->txhead, PIPE_SLOTS)) {
+            pfd.fd = p->tx.pfd;
+            pfd.events = POLLIN;
+            if (poll (&pfd, 1, -1) > 0)
+                efd_clear (p->tx.pfd);
+        }
+    }
+    s = &p->txslots[p->txhead++ % PIPE_SLOTS];
+    s->len = len;
+    memcpy (&s->pkt, pkt, len);
+    return len;
+}
+
+/* Feed what the RX thread received to the protocol.  After a ring's
+ * worth, yield to the rest of the loop (timers, output), but leave the
+ * eventfd signalled so that it comes straight back. */
+static void
+netpipe_recv (conn_t *c, const struct config_common *cc)
+{
+    struct netpipe *p = npipe;
+    uint64_t tail = p->rx.tail, n;
+    int budget = PIPE_SLOTS;
+
+    efd_clear (p->rx.cfd);
+    while (!c->delete_me) {
+        n = __atomic_load_n (&p->rx.head, __ATOMIC_ACQUIRE) - tail;
+        if (!n && !(n = spsc_carm (&p->rx, tail)))
+            break;
+        if (!budget) {
+            efd_signal (p->rx.cfd);
+            break;
+        }
+        for (; n && budget && !c->delete_me; n--, budget--) {
+            struct pktslot *s = &p->rxslots[tail++ % PIPE_SLOTS];
+            if (s->len < 0) {
+                spsc_release (&p->rx, tail);
+                conn_peer_dead (c, cc);
+                return;
+            }
+            rel_recvpkt (c->rel, &s->pkt, s->len);
+        }
+        spsc_release (&p->rx, tail);
+    }
+}
+
+/* The stdio thread: move input into the in ring and output out of the
+ * out ring as far as the descriptors let it, then sleep until they or
+ * the loop are ready for more. */
+static void *
+sio_thread (void *arg)
+{
+    struct sio *s = arg;
+    struct pollfd pfd[3];
+    struct iovec iov[2];
+    uint64_t ihead = 0, otail = 0, room, pending;
+    int in_eof = 0, shut = 0, busy;
+    ssize_t n;
+
+    pfd[2].fd = s->in.pfd;
+    pfd[2].events = POLLIN;
+    for (;;) {
+        busy = 0;
+        room = STDIO_RING
+            - (ihead - __atomic_load_n (&s->in.tail, __ATOMIC_ACQUIRE));
+        pending = __atomic_load_n (&s->out.head, __ATOMIC_ACQUIRE) - otail;
+
+        if (room && !in_eof) {
+            size_t at = ihead % STDIO_RING;
+            iov[0].iov_base = s->ibuf + at;
+            iov[0].iov_len = STDIO_RING - at < room ? STDIO_RING - at : room;
+            iov[1].iov_base = s->ibuf;
+            iov[1].iov_len = room - iov[0].iov_len;
+            n = readv (s->rfd, iov, iov[1].iov_len ? 2 : 1);
+            if (n > 0) {
+                ihead += n;
+                spsc_publish (&s->in, ihead);
+                busy = 1;
+            }
+            else if (n == 0 || errno != EAGAIN) {
+                if (n < 0)
+                    perror ("read");
+                in_eof = 1;
+                __atomic_store_n (&s->in_eof, 1, __ATOMIC_SEQ_CST);
+                spsc_wake (&s->in.cwaits, s->in.cfd);
+            }
+        }
+
+        if (pending) {
+            size_t at = otail % STDIO_RING;
+            iov[0].iov_base = s->obuf + at;
+            iov[0].iov_len = STDIO_RING - at < pending
+                ? STDIO_RING - at : pending;
+            iov[1].iov_base = s->obuf;
+            iov[1].iov_len = pending - iov[0].iov_len;
+            n = writev (s->wfd, iov, iov[1].iov_len ? 2 : 1);
+            if (n > 0) {
+                otail += n;
+                spsc_release (&s->out, otail);
+                busy = 1;
+            }
+            else if (n < 0 && errno != EAGAIN) {
+                perror ("write");
+                __atomic_store_n (&s->out_err, 1, __ATOMIC_SEQ_CST);
+                otail += pending;
+                spsc_release (&s->out, otail);
+            }
+        }
+        else if (!shut && __atomic_load_n (&s->out_eof, __ATOMIC_ACQUIRE)) {
+            shutdown (s->wfd, SHUT_WR);
+            shut = 1;
+        }
+        if (busy)
+            continue;
+        if (__atomic_load_n (&s->stop, __ATOMIC_ACQUIRE))
+            break;
+
+        /* Sleep; the loop wakes us when it frees input room or queues
+         * output. */
+        if (!room && !in_eof && spsc_parm (&s->in, ihead, STDIO_RING))
+            continue;
+        if (!pending && spsc_carm (&s->out, otail))
+            continue;
+        pfd[0].fd = room && !in_eof ? s->rfd : -1;
+        pfd[0].events = POLLIN;
+        pfd[1].fd = pending ? s->wfd : -1;
+        pfd[1].events = POLLOUT;
+        if (poll (pfd, 3, -1) > 0 && pfd[2].revents)
+            efd_clear (s->in.pfd);
+    }
+    return NULL;
+}
+
+static void
+sio_start (conn_t *c)
+{
+    struct sio *s = xmalloc (sizeof (*s));
+    int lfd = efd_new (), tfd = efd_new ();
+
+    memset (s, 0, sizeof (*s));
+    s->rfd = c->rfd;
+    s->wfd = c->wfd;
+    /* One eventfd wakes the loop, the other the thread. */
+    spsc_init (&s->in, lfd, tfd);
+    spsc_init (&s->out, tfd, lfd);
+    s->in.cwaits = 1;
+    s->ibuf = xmalloc (STDIO_RING);
+    s->obuf = xmalloc (STDIO_RING);
+    if ((errno = pthread_create (&s->tid, NULL, sio_thread, s))) {
+        perror ("pthread_create");
+        exit (1);
+    }
+    c->sio = s;
+}
+
+static void
+sio_stop (conn_t *c)
+{
+    struct sio *s = c->sio;
+
+    __atomic_store_n (&s->stop, 1, __ATOMIC_SEQ_CST);
+    efd_signal (s->in.pfd);
+    pthread_join (s->tid, NULL);
+    close (s->in.cfd);
+    close (s->in.pfd);
+    free (s->ibuf);
+    free (s->obuf);
+    free (s);
+    c->sio = NULL;
+}
+
+/* conn_input_avail with -I. */
+static int
+sio_input_avail (conn_t *c)
+{
+    struct sio *s = c->sio;
+    int eof = __atomic_load_n (&s->in_eof, __ATOMIC_SEQ_CST);
+    uint64_t n = __atomic_load_n (&s->in.head, __ATOMIC_ACQUIRE) - s->in.tail;
+
+    /* Input before the EOF is all in by the time in_eof is set. */
+    if (!n && !(n = spsc_carm (&s->in, s->in.tail))) {
+        if (!eof)
+            return 0;
+        c->read_eof = 1;
+        return -1;
+    }
+    return n;
+}
+
+/* conn_input with -I. */
+static int
+sio_input (conn_t *c, void *buf, size_t n)
+{
+    struct sio *s = c->sio;
+    int avail = sio_input_avail (c);
+    size_t at = s->in.tail % STDIO_RING, first;
+
+    if (avail <= 0)
+        return avail;
+    if (n > (size_t) avail)
+        n = avail;
+    first = STDIO_RING - at < n ? STDIO_RING - at : n;
+    memcpy (buf, s->ibuf + at, first);
+    memcpy ((char *) buf + first, s->ibuf, n - first);
+    spsc_release (&s->in, s->in.tail + n);
+    if (log_in >= 0)
+        log_append (0, buf, n);
+    return n;
+}
+
+/* conn_bufspace with -I.  While output is queued, the thread is asked
+ * to wake the loop as it makes room. */
+static size_t
+sio_bufspace (conn_t *c)
+{
+    struct sio *s = c->sio;
+
+    if (s->out.head != __atomic_load_n (&s->out.tail, __ATOMIC_ACQUIRE))
+        __atomic_store_n (&s->out.pwaits, 1, __ATOMIC_SEQ_CST);
+    return STDIO_RING
+        - (s->out.head - __atomic_load_n (&s->out.tail, __ATOMIC_SEQ_CST));
+}
+
+/* conn_outputv with -I: queue as much as fits. */
+static int
+sio_outputv (conn_t *c, const struct iovec *iov, int iovcnt)
+{
+    struct sio *s = c->sio;
+    size_t space = sio_bufspace (c), accepted = 0;
+    uint64_t head = s->out.head;
+    int i;
+
+    if (__atomic_load_n (&s->out_err, __ATOMIC_ACQUIRE)) {
+        c->write_err = 2;
+        return -1;
+    }
+    for (i = 0; i < iovcnt && accepted < space; i++) {
+        size_t n = iov[i].iov_len, at = head % STDIO_RING, first;
+        if (n > space - accepted)
+            n = space - accepted;
+        first = STDIO_RING - at < n ? STDIO_RING - at : n;
+        memcpy (s->obuf + at, iov[i].iov_base, first);
+        memcpy (s->obuf, (const char *) iov[i].iov_base + first, n - first);
+        if (log_out >= 0)
+            log_append (1, iov[i].iov_base, n);
+        head += n;
+        accepted += n;
+    }
+    spsc_publish (&s->out, head);
+    return accepted;
+}
+
+/* conn_output (c, NULL, 0) with -I. */
+static void
+sio_output_eof (conn_t *c)
+{
+    struct sio *s = c->sio;
+
+    __atomic_store_n (&s->out_eof, 1, __ATOMIC_SEQ_CST);
+    spsc_wake (&s->out.cwaits, s->out.cfd);
+}
+
+/* The stdio thread has input, or room for output. */
+static void
+sio_ready (conn_t *c)
+{
+    efd_clear (c->sio->in.cfd);
+    conn_ready (c, c->read_eof ? READY_OUTPUT : READY_INPUT|READY_OUTPUT);
+}
+#endif /* HAVE_PIPELINE */
+
+/* Push out any queued packets. */
+static void
+conn_flush (void)
+{
+#if HAVE_IO_URING
+    if (uring_active ())
+        uring_submit (0);
+#endif /* HAVE_IO_URING */
+#if HAVE_MMSG
+    if (nsendq)
+        sendq_flush ();
+#endif /* HAVE_MMSG */
+#if HAVE_PIPELINE
+    if (npipe && npipe->txhead != npipe->tx.head)
+        spsc_publish (&npipe->tx, npipe->txhead);
+#endif /* HAVE_PIPELINE */
+}
+
+int
+conn_sendpkt (conn_t *c, const packet_t *pkt, size_t len)
+{
+    int n = -1;
+    assert (!c->delete_me);
+#if HAVE_PIPELINE
+    if (npipe && !c->server)
+        return netpipe_send (pkt, len);
+#endif /* HAVE_PIPELINE */
+#if HAVE_IO_URING
+    if (!c->server && uring_active ()
+            && (n = uring_send (c, pkt, len)) >= 0) {
+        if (opt_debug)
+            print_pkt (pkt, "send", n);
+        return n;
+    }
+#endif /* HAVE_IO_URING */
+#if HAVE_MMSG
+    if (len <= sizeof (*pkt)) {
+        sendq_push (c->nfd, c->server ? &c->peer : NULL, pkt, len);
+        return len;
+    }
+#endif /* HAVE_MMSG */
+    if (c->server)
+        n = sendto (c->nfd, pkt, len, MSG_DONTWAIT,
+                    (const struct sockaddr *) &c->peer, addrsize (&c->peer));
+    else
+        n = send (c->nfd, pkt, len, MSG_DONTWAIT);
+    if (opt_debug)
+        print_pkt (pkt, "send", n);
+    return n;
+}
+
+#if HAVE_VMSPLICE
+/* Set up zero-copy output, if wfd is a pipe. */
+static void
+conn_pipe_init (conn_t *c)
+{
+    struct stat sb;
+    long page = sysconf (_SC_PAGESIZE);
+    int psz;
+    void *p;
+
+    if (fstat (c->wfd, &sb) < 0 || !S_ISFIFO (sb.st_mode)
+            || (psz = fcntl (c->wfd, F_GETPIPE_SZ)) <= 0)
+        return;
+    c->ocap = ((2 * (size_t) psz + page - 1) / page) * page;
+    p = mmap (NULL, c->ocap, PROT_READ|PROT_WRITE,
+              MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+    if (p == MAP_FAILED) {
+        perror ("mmap");
+        c->ocap = OUTBUF_SIZE;
+        return;
+    }
+    c->obuf = p;
+    c->opipe = 1;
+}
+
+/* Forget about spliced bytes the other end has read since. */
+static void
+conn_pipe_unpin (conn_t *c)
+{
+    int n;
+
+    /* The pipe may also hold bytes written directly before the splice,
+     * so this is an upper bound; it reaches 0 once the pipe is empty. */
+    if (ioctl (c->wfd, FIONREAD, &n) == 0 && (size_t) n < c->opinned)
+        c->opinned = n;
+}
+#endif /* HAVE_VMSPLICE */
+
+/* Count n bytes written out towards the drain rate. */
+static void
+conn_orate_add (conn_t *c, size_t n)
+{
+    uint64_t now = conn_now_ns ();
+    size_t rate;
+
+    c->obytes += n;
+    if (!c->ostamp)
+        c->ostamp = now;
+    if (now - c->ostamp < 10000000)
+        return;
+    rate = c->obytes * 1000000 / (now - c->ostamp);
+    c->orate = c->orate ? (3 * c->orate + rate) / 4 : rate;
+    c->obytes = 0;
+    c->ostamp = now;
+}
+
+/* Move the output ring to one of capacity cap (at least olen), if
+ * the budget allows.  Returns 0 on success, -1 if not. */
+static int
+conn_obuf_resize (conn_t *c, size_t cap)
+{
+    size_t first = c->ocap - c->ohead;
+    char *p = NULL;
+
+    if (cap > c->ocap
+            && __atomic_add_fetch (&obuf_used, cap - c->ocap, __ATOMIC_RELAXED)
+               > obuf_budget) {
+        __atomic_sub_fetch (&obuf_used, cap - c->ocap, __ATOMIC_RELAXED);
+        return -1;
+    }
+    if (cap < c->ocap)
+        __atomic_sub_fetch (&obuf_used, c->ocap - cap, __ATOMIC_RELAXED);
+    if (c->olen) {
+        p = xmalloc (cap);
+        if (c->olen <= first)
+            memcpy (p, c->obuf + c->ohead, c->olen);
+        else {
+            memcpy (p, c->obuf + c->ohead, first);
+            memcpy (p + first, c->obuf, c->olen - first);
+        }
+    }
+    free (c->obuf);
+    c->obuf = p;		/* or allocated again on first use */
+    c->ohead = 0;
+    c->ocap = cap;
+    return 0;
+}
+
+/* Give a grown output ring back once it has been empty for
+ * OUTBUF_IDLE, or look again when that will be the case.  Rings are
+ * sized by their peaks, so an idle connection would otherwise keep
+ * what its last burst took. */
+static void
+conn_obuf_idle (conn_t *c, uint64_t now)
+{
+    uint64_t idle = (uint64_t) OUTBUF_IDLE * 1000000;
+
+    if (c->opipe || c->olen || c->ocap <= OUTBUF_SIZE)
+        return;
+    if (now - c->oidle >= idle)
+        conn_obuf_resize (c, OUTBUF_SIZE);
+    else
+        conn_timer (c, (c->oidle + idle - now + 999999) / 1000000);
+}
+
+/* How far the output ring may grow: twice what drains in a round
+ * trip, within OUTBUF_SIZE..OUTBUF_MAX. */
+static size_t
+conn_olimit (conn_t *c)
+{
+    size_t lim = 2 * c->orate * (c->ortt ? c->ortt : OUTBUF_RTT);
+
+    return lim < OUTBUF_SIZE ? OUTBUF_SIZE : lim > OUTBUF_MAX ? OUTBUF_MAX : lim;
+}
+
+void
+conn_set_rtt (conn_t *c, long ms)
+{
+    c->ortt = ms > 0 ? ms : 1;
+}
+
+size_t
+conn_bufspace (conn_t *c)
+{
+#if HAVE_PIPELINE
+    if (c->sio)
+        return sio_bufspace (c);
+#endif /* HAVE_PIPELINE */
+#if HAVE_VMSPLICE
+    /* Nothing tells us when the reader empties the pipe; look again
+     * soon while it still holds some of our pages. */
+    if (c->opinned) {
+        conn_pipe_unpin (c);
+        if (c->opinned)
+            conn_timer (c, 1);
+    }
+#endif /* HAVE_VMSPLICE */
+    /* Output is backing up: make room, if it drains fast enough. */
+    if (!c->opipe && c->olen > c->ocap / 2 && c->ocap < conn_olimit (c))
+        conn_obuf_resize (c, 2 * c->ocap);
+    return conn_bufroom (c);
+}
+
+size_t
+conn_bufroom (conn_t *c)
+{
+#if HAVE_PIPELINE
+    if (c->sio)
+        return STDIO_RING - (c->sio->out.head
+            - __atomic_load_n (&c->sio->out.tail, __ATOMIC_ACQUIRE));
+#endif /* HAVE_PIPELINE */
+    return c->ocap - c->olen - c->opinned;
+}
+
+/* Append n bytes (no more than conn_bufspace) to the output ring. */
+static void
+conn_obuf_put (conn_t *c, const char *buf, size_t n)
+{
+    size_t tail = (c->ohead + c->olen) % c->ocap;
+    size_t first = n < c->ocap - tail ? n : c->ocap - tail;
+
+    if (!c->obuf)
+        c->obuf = xmalloc (c->ocap);
+    memcpy (c->obuf + tail, buf, first);
+    memcpy (c->obuf, buf + first, n - first);
+    c->olen += n;
+    if (c->olen > c->opeak)
+        c->opeak = c->olen;
+}
+
+/* Use a mapping for input, if rfd is a regular file with data left
+ * after its current offset (which is where input starts, as with
+ * read). */
+static void
+conn_map_input (conn_t *c)
+{
+    struct stat sb;
+    off_t pos;
+    void *p;
+
+    if (fstat (c->rfd, &sb) < 0 || !S_ISREG (sb.st_mode)
+            || (pos = lseek (c->rfd, 0, SEEK_CUR)) < 0 || pos >= sb.st_size)
+        return;
+    p = mmap (NULL, sb.st_size, PROT_READ, MAP_SHARED, c->rfd, 0);
+    if (p == MAP_FAILED) {
+        perror ("mmap");
+        return;
+    }
+    madvise (p, sb.st_size, MADV_SEQUENTIAL);
+    c->imap = p;
+    c->imaplen = sb.st_size;
+    c->ipos = pos;
+}
+
+const char *
+conn_input_map (conn_t *c, size_t *pos)
+{
+    if (pos)
+        *pos = c->ipos;
+    return c->imap;
+}
+
+/* Write output through a mapping (-m), if wfd is a regular file. */
+static void
+conn_map_output (conn_t *c)
+{
+    struct stat sb;
+    char name[40];
+
+    if (fstat (c->wfd, &sb) < 0 || !S_ISREG (sb.st_mode)
+            || (c->opos = lseek (c->wfd, 0, SEEK_CUR)) < 0) {
+        fprintf (stderr, "%s: output is not a regular file, ignoring -m\n",
+                 progname);
+        return;
+    }
+    if (fcntl (c->wfd, F_GETFL) & O_APPEND)
+        c->opos = sb.st_size;
+    /* A shared writable mapping needs the file open for reading too,
+     * which stdout usually isn't. */
+    snprintf (name, sizeof (name), "/proc/self/fd/%d", c->wfd);
+    if ((c->omapfd = open (name, O_RDWR)) < 0) {
+        perror (name);
+        fprintf (stderr, "%s: ignoring -m\n", progname);
+        return;
+    }
+    c->omapped = 1;
+}
+
+/* Map the chunk of the output file that holds offset opos. */
+static int
+conn_omap_move (conn_t *c)
+{
+    off_t off = c->opos & ~((off_t) OUTMAP_CHUNK - 1);
+    int err;
+    void *p;
+
+    if (c->omap)
+        munmap (c->omap, OUTMAP_CHUNK);
+    c->omap = NULL;
+    /* Also extends the file, so that the whole mapping is backed. */
+    if ((err = posix_fallocate (c->omapfd, off, OUTMAP_CHUNK))) {
+        errno = err;
+        perror ("fallocate");
+        return -1;
+    }
+    p = mmap (NULL, OUTMAP_CHUNK, PROT_READ|PROT_WRITE, MAP_SHARED,
+              c->omapfd, off);
+    if (p == MAP_FAILED) {
+        perror ("mmap");
+        return -1;
+    }
+    c->omap = p;
+    c->omapoff = off;
+    return 0;
+}
+
+/* Finish mapped output: drop the mapping and the preallocated tail. */
+static void
+conn_omap_close (conn_t *c)
+{
+    if (!c->omapped)
+        return;
+    if (c->omap)
+        munmap (c->omap, OUTMAP_CHUNK);
+    c->omap = NULL;
+    c->omapped = 0;
+    if (ftruncate (c->omapfd, c->opos) < 0)
+        perror ("ftruncate");
+    close (c->omapfd);
+}
+
+/* conn_outputv for mapped output: every byte is accepted at once. */
+static int
+conn_omap_put (conn_t *c, const struct iovec *iov, int iovcnt)
+{
+    size_t total = 0;
+    int i;
+
+    for (i = 0; i < iovcnt; i++) {
+        const char *buf = iov[i].iov_base;
+        size_t n = iov[i].iov_len;
+
+        while (n > 0) {
+            size_t at = c->opos - c->omapoff, k;
+            if (!c->omap || c->opos < c->omapoff || at >= OUTMAP_CHUNK) {
+                if (conn_omap_move (c) < 0) {
+                    c->write_err = 2;
+                    return -1;
+                }
+                at = c->opos - c->omapoff;
+            }
+            k = n < OUTMAP_CHUNK - at ? n : OUTMAP_CHUNK - at;
+            memcpy (c->omap + at, buf, k);
+            c->opos += k;
+            buf += k;
+            n -= k;
+        }
+        if (log_out >= 0)
+            log_append (1, iov[i].iov_base, iov[i].iov_len);
+        total += iov[i].iov_len;
+    }
+    return total;
+}
+
+int
+conn_output_rewind (conn_t *c, uint64_t off)
+{
+    struct stat sb;
+    int fd = c->omapped ? c->omapfd : c->wfd;
+
+    if (c->olen || fstat (fd, &sb) < 0 || !S_ISREG (sb.st_mode)
+            || (uint64_t) sb.st_size < off)
+        return -1;
+    if (c->omapped) {
+        c->opos = off;		/* the tail goes in conn_omap_close */
+        return 0;
+    }
+    if (ftruncate (fd, off) < 0 || lseek (fd, off, SEEK_SET) < 0) {
+        perror ("rewind");
+        return -1;
+    }
+    return 0;
 }
 
 int
 conn_output (conn_t *c, const void *_buf, size_t _n)
 {
-    const char *buf = _buf;
-    int n = _n;
+    struct iovec iov;
 
     assert (!c->delete_me && !c->write_eof);
 
-    if (n == 0) {
+    if (_n == 0) {
         c->write_eof = 1;
-        if (!c->outq)
+#if HAVE_PIPELINE
+        if (c->sio) {
+            sio_output_eof (c);
+            return 0;
+        }
+#endif /* HAVE_PIPELINE */
+        conn_omap_close (c);
+        if (!c->olen)
             shutdown (c->wfd, SHUT_WR);
         return 0;
     }
 
+    iov.iov_base = (void *) _buf;
+    iov.iov_len = _n;
+    return conn_outputv (c, &iov, 1);
+}
+
+int
+conn_outputv (conn_t *c, const struct iovec *iov, int iovcnt)
+{
+    size_t done = 0, accepted, space, skip;
+    int i;
+
+    assert (!c->delete_me && !c->write_eof);
+
     if (c->write_err) {
         if (c->write_err == 2)
             fprintf (stderr, "conn_output: attempt to write after error\n");
@@ -189,14 +2273,19 @@ conn_output (conn_t *c, const void *_buf, size_t _n)
         return -1;
     }
 
-    if (!conn_bufspace (c))
-        return 0;
+    if (c->omapped)
+        return conn_omap_put (c, iov, iovcnt);
+#if HAVE_PIPELINE
+    if (c->sio)
+        return sio_outputv (c, iov, iovcnt);
+#endif /* HAVE_PIPELINE */
 
-    if (log_out >= 0)
-        write (log_out, buf, n);
+    if (!(space = conn_bufspace (c)))
+        return 0;
 
-    if (!c->outq) {
-        int r = write (c->wfd, buf, n);
+    /* Nothing queued, so the whole batch can go straight out. */
+    if (!c->olen && !c->opinned) {
+        int r = writev (c->wfd, iov, iovcnt);
         if (r < 0) {
             if (errno != EAGAIN) {
                 perror ("write");
@@ -205,51 +2294,253 @@ conn_output (conn_t *c, const void *_buf, size_t _n)
             }
         }
         else {
-            buf += r;
-            n -= r;
+            done = r;
+            conn_orate_add (c, r);
         }
     }
 
-    if (n > 0) {
-        chunk_t *ch = xmalloc (offsetof (chunk_t, buf[n]));
-        ch->next = NULL;
-        ch->size = n;
-        ch->used = 0;
-        memcpy (ch->buf, buf, n);
-        *c->outqtail = ch;
-        c->outqtail = &ch->next;
+    /* Queue what the fd didn't take, as far as it fits. */
+    accepted = done;
+    for (i = 0, skip = done; i < iovcnt && space; i++) {
+        size_t n = iov[i].iov_len;
+        if (skip >= n) {
+            skip -= n;
+            continue;
+        }
+        n -= skip;
+        if (n > space)
+            n = space;
+        conn_obuf_put (c, (const char *) iov[i].iov_base + skip, n);
+        accepted += n;
+        space -= n;
+        skip = 0;
     }
 
-    if (c->wpoll && c->outq)
-    cevents[c->wpoll].events |= POLLOUT;
-    return _n;
+    if (log_out >= 0)
+        for (i = 0, skip = accepted; i < iovcnt && skip; i++) {
+            size_t n = iov[i].iov_len < skip ? iov[i].iov_len : skip;
+            log_append (1, iov[i].iov_base, n);
+            skip -= n;
+        }
+
+    if (c->olen)
+        conn_wwant (c, 1);
+    return accepted;
 }
 
-int
-conn_input (conn_t *c, void *buf, size_t n)
+/* Read as much as fits into the free part of the input ring (at most
+ * two runs, so one readv).  Sets read_eof on EOF or error. */
+static void
+conn_ibuf_fill (conn_t *c)
 {
-    int r;
-    assert (!c->delete_me);
+    struct iovec iov[2];
+    size_t tail = (c->ihead + c->ilen) % c->icap;
+    size_t space = c->icap - c->ilen;
+    int cnt = 1, r;
+
+    if (!c->ibuf)
+        c->ibuf = xmalloc (c->icap);
+
+    iov[0].iov_base = c->ibuf + tail;
+    iov[0].iov_len = space < c->icap - tail ? space : c->icap - tail;
+    if (space > iov[0].iov_len) {
+        iov[1].iov_base = c->ibuf;
+        iov[1].iov_len = space - iov[0].iov_len;
+        cnt = 2;
+    }
 
-    if (c->read_eof)
-        return -1;
-    r = read (c->rfd, buf, n);
+    r = readv (c->rfd, iov, cnt);
     if (r == 0 || (r < 0 && errno != EAGAIN)) {
         if (r == 0)
             errno = EIO;
-        r = -1;
         c->read_eof = 1;
-        return r;
+        conn_rwant (c, 0);
+    }
+    else if (r > 0)
+        c->ilen += r;
+}
+
+int
+conn_input_avail (conn_t *c)
+{
+    assert (!c->delete_me);
+
+    if (c->imap)
+        return c->ipos < c->imaplen ? 1 : -1;
+#if HAVE_PIPELINE
+    if (c->sio)
+        return sio_input_avail (c);
+#endif /* HAVE_PIPELINE */
+    if (!c->ilen && !c->read_eof)
+        conn_ibuf_fill (c);
+    if (c->ilen)
+        return c->ilen;
+    if (c->read_eof)
+        return -1;
+    c->xoff = 0;
+    conn_rwant (c, 1);
+    return 0;
+}
+
+ssize_t
+conn_input_pread (conn_t *c, void *buf, size_t n, uint64_t off)
+{
+    if (c->imap) {
+        if (off > c->imaplen)
+            return -1;
+        if (n > c->imaplen - off)
+            n = c->imaplen - off;
+        memcpy (buf, c->imap + off, n);
+        return n;
     }
-    if (r < 0 && errno == EAGAIN)
-        r = 0;
+    return pread (c->rfd, buf, n, off);
+}
 
-    if (r > 0 && log_in >= 0)
-        write (log_in, buf, r);
+int
+conn_input_seek (conn_t *c, uint64_t off)
+{
+    struct stat sb;
 
+    if (c->imap) {
+        if (off > c->imaplen)
+            return -1;
+        c->ipos = off;
+    }
+    else {
+        if (fstat (c->rfd, &sb) < 0 || !S_ISREG (sb.st_mode)
+                || (uint64_t) sb.st_size < off
+                || lseek (c->rfd, off, SEEK_SET) < 0)
+            return -1;
+        c->ihead = c->ilen = 0;
+    }
+    c->read_eof = 0;
     c->xoff = 0;
-    cevents[c->rpoll].events |= POLLIN;
-    return r;
+    conn_rwant (c, 1);
+    return 0;
+}
+
+int
+conn_input (conn_t *c, void *buf, size_t n)
+{
+    size_t first;
+    assert (!c->delete_me);
+
+    if (c->imap) {
+        if (c->ipos == c->imaplen) {
+            c->read_eof = 1;
+            conn_rwant (c, 0);
+            return -1;
+        }
+        if (n > c->imaplen - c->ipos)
+            n = c->imaplen - c->ipos;
+        memcpy (buf, c->imap + c->ipos, n);
+        c->ipos += n;
+        if (log_in >= 0)
+            log_append (0, buf, n);
+        return n;
+    }
+#if HAVE_PIPELINE
+    if (c->sio)
+        return sio_input (c, buf, n);
+#endif /* HAVE_PIPELINE */
+
+    /* Only go to the fd when the ring can't fill the whole request. */
+    if (c->ilen < n && c->ilen < c->icap && !c->read_eof)
+        conn_ibuf_fill (c);
+
+    if (!c->ilen) {
+        if (c->read_eof)
+            return -1;
+        c->xoff = 0;
+        conn_rwant (c, 1);
+        return 0;
+    }
+
+    if (n > c->ilen)
+        n = c->ilen;
+    first = c->icap - c->ihead;
+    if (first > n)
+        first = n;
+    memcpy (buf, c->ibuf + c->ihead, first);
+    memcpy ((char *) buf + first, c->ibuf, n - first);
+    c->ihead = (c->ihead + n) % c->icap;
+    c->ilen -= n;
+    if (!c->ilen)
+        c->ihead = 0;
+
+    if (log_in >= 0)
+        log_append (0, buf, n);
+
+    if (!c->read_eof) {
+        c->xoff = 0;
+        conn_rwant (c, 1);
+    }
+    return n;
+}
+
+static size_t
+peertab_slot (unsigned int h)
+{
+    /* addrhash is weak in its low bits; mix before masking. */
+    h ^= h >> 16;
+    h *= 0x45d9f3b;
+    h ^= h >> 16;
+    return h & (peertab_size - 1);
+}
+
+static void
+peertab_put (conn_t *c)
+{
+    size_t i;
+
+    for (i = peertab_slot (c->hash); peertab[i];
+         i = (i + 1) & (peertab_size - 1))
+        ;
+    peertab[i] = c;
+}
+
+static void
+peertab_insert (conn_t *c)
+{
+    if (2 * (peertab_used + 1) > peertab_size) {
+        conn_t **old = peertab;
+        size_t i, n = peertab_size;
+
+        peertab_size = n ? 2 * n : 64;
+        peertab = xmalloc (peertab_size * sizeof (*peertab));
+        memset (peertab, 0, peertab_size * sizeof (*peertab));
+        for (i = 0; i < n; i++)
+            if (old[i])
+                peertab_put (old[i]);
+        free (old);
+    }
+    peertab_put (c);
+    peertab_used++;
+}
+
+static void
+peertab_remove (conn_t *c)
+{
+    size_t mask = peertab_size - 1;
+    size_t i, j, k;
+
+    for (i = peertab_slot (c->hash); peertab[i] != c; i = (i + 1) & mask)
+        assert (peertab[i]);
+
+    /* Shift later members of the probe run back, so that lookups never
+     * need tombstones. */
+    for (j = i;;) {
+        j = (j + 1) & mask;
+        if (!peertab[j])
+            break;
+        k = peertab_slot (peertab[j]->hash);
+        if (i <= j ? (i < k && k <= j) : (i < k || k <= j))
+            continue;
+        peertab[i] = peertab[j];
+        i = j;
+    }
+    peertab[i] = NULL;
+    peertab_used--;
 }
 
 static conn_t *
@@ -259,7 +2550,8 @@ conn_alloc (void)
     memset (c, 0, sizeof (*c));
     c->prev = &conn_list;
     c->next = conn_list;
-    c->outqtail = &c->outq;
+    c->ocap = OUTBUF_SIZE;
+    c->icap = INBUF_SIZE;
     if (conn_list)
         conn_list->prev = &c->next;
     conn_list = c;
@@ -299,81 +2591,152 @@ conn_create (rel_t *rel, const struct sockaddr_storage *ss)
     c->nfd = serverconf->udp_socket;
     c->rfd = c->wfd = n;
     c->server = 1;
+    c->hash = addrhash (ss);
+    peertab_insert (c);
+    conn_register (c);
 
     return c;
 }
 
 static void
-conn_free (conn_t *c)
+conn_free (conn_t *c, const struct config_common *cc)
 {
-    chunk_t *ch, *nch;
-
-    for (ch = c->outq; ch; ch = nch) {
-        nch = ch->next;
-        free (ch);
+#if HAVE_IO_URING
+    if (!c->server && uring_active ())
+        uring_drain (cc);
+#endif /* HAVE_IO_URING */
+#if HAVE_PIPELINE
+    if (c->sio)
+        sio_stop (c);
+    if (npipe && !c->server)
+        netpipe_stop ();
+#endif /* HAVE_PIPELINE */
+#if HAVE_VMSPLICE
+    if (c->opipe)
+        munmap (c->obuf, c->ocap);	/* pages live on in the pipe */
+    else
+#endif /* HAVE_VMSPLICE */
+    {
+        free (c->obuf);
+        __atomic_sub_fetch (&obuf_used, c->ocap - OUTBUF_SIZE,
+                            __ATOMIC_RELAXED);
     }
+    free (c->ibuf);
+    if (c->imap)
+        munmap ((void *) c->imap, c->imaplen);
+    conn_omap_close (c);
 
     if (c->next)
         c->next->prev = c->prev;
     *c->prev = c->next;
 
+    conn_unregister (c);
+    if (c->server)
+        peertab_remove (c);
     close (c->rfd);
     if (c->wfd != c->rfd)
         close (c->wfd);
     if (!c->server)
         close (c->nfd);
 
-    cevents_generation++;
-
     /* to help catch errors */
     memset (c, 0xc5, sizeof (*c));
     free (c);
 }
 
+/* A protocol error: stop writing c's output, discarding whatever is
+ * still buffered, and make the program exit nonzero. */
+void
+conn_abort (conn_t *c)
+{
+    c->write_err = 2;
+    __atomic_store_n (&conn_failed, 1, __ATOMIC_RELAXED);
+}
+
 void
 conn_destroy (conn_t *c)
 {
+    if (c->delete_me)
+        return;
     c->delete_me = 1;
+    theap_remove (c);
+    c->dnext = dead_list;
+    dead_list = c;
 }
 
 void
 conn_drain (conn_t *c)
 {
-    chunk_t *ch;
+    struct iovec iov[2];
     int didsome = 0;
 
-    if (c->wpoll)
-        cevents[c->wpoll].events &= ~POLLOUT;
-
-    if (c->write_err)
+    if (c->write_err) {
+        conn_wwant (c, 0);
         return;
+    }
 
-    while ((ch = c->outq)) {
-        int n = write (c->wfd, ch->buf + ch->used,
-        ch->size - ch->used);
+    /* The ring holds at most two contiguous runs: one writev. */
+    while (c->olen) {
+        size_t first = c->ocap - c->ohead;
+        int cnt = 1, n;
+
+        iov[0].iov_base = c->obuf + c->ohead;
+        iov[0].iov_len = c->olen < first ? c->olen : first;
+        if (c->olen > first) {
+            iov[1].iov_base = c->obuf;
+            iov[1].iov_len = c->olen - first;
+            cnt = 2;
+        }
+#if HAVE_VMSPLICE
+        if (c->opipe)
+            n = vmsplice (c->wfd, iov, cnt, SPLICE_F_NONBLOCK);
+        else
+#endif /* HAVE_VMSPLICE */
+            n = writev (c->wfd, iov, cnt);
         if (n < 0) {
             if (errno != EAGAIN)
                 c->write_err = 1;
             break;
         }
         didsome = 1;
-        ch->used += n;
-        if (ch->used < ch->size) {
-            if (c->wpoll)
-                cevents[c->wpoll].events |= POLLOUT;
-            break;
+        conn_orate_add (c, n);
+        c->ohead = (c->ohead + n) % c->ocap;
+        c->olen -= n;
+        if (c->opipe)
+            c->opinned += n;	/* and keep ohead: the pipe still reads there */
+        else if (!c->olen) {
+            c->ohead = 0;
+            /* Hardly used since it was last empty: shrink. */
+            if (c->ocap > OUTBUF_SIZE && c->opeak <= c->ocap / 4)
+                conn_obuf_resize (c, c->ocap / 2);
+            c->opeak = 0;
+            if (c->ocap > OUTBUF_SIZE) {
+                c->oidle = conn_now_ns ();
+                conn_timer (c, OUTBUF_IDLE);
+            }
         }
-        c->outq = ch->next;
-        if (!c->outq)
-            c->outqtail = &c->outq;
-        free (ch);
+        if (c->olen)
+            break;		/* short write; wait for POLLOUT */
     }
-    if (c->write_eof && !c->write_err && !c->outq) {
+    conn_wwant (c, c->olen && !c->write_err);
+    if (c->write_eof && !c->write_err && !c->olen) {
         c->write_err = 1;
         shutdown (c->wfd, SHUT_WR);
     }
-    if (didsome && !c->delete_me)
-        rel_output (c->rel);
+    if (didsome)
+        conn_ready (c, READY_OUTPUT);
+}
+
+/* Output accepted but not yet written to wfd. */
+static size_t
+conn_opending (conn_t *c)
+{
+#if HAVE_PIPELINE
+    if (c->sio)
+        return __atomic_load_n (&c->sio->out_err, __ATOMIC_ACQUIRE)
+            ? 0 : STDIO_RING - sio_bufspace (c);
+#endif /* HAVE_PIPELINE */
+    return c->olen;
 }
 
 static void
@@ -381,11 +2744,15 @@ conn_mkevents (void)
 {
     struct pollfd *e;
     conn_t **r, **w;
-    size_t n = 2;
+    size_t n = 2 + uring_active ();
     conn_t *c;
 
     for (c = conn_list; c; c = c->next) {
-        if (c->read_eof) {
+        if (c->sio) {
+            c->rpoll = n++;		/* the stdio thread's eventfd */
+            c->wpoll = 0;
+        }
+        else if (c->read_eof) {
             c->rpoll = 0;
             if (c->write_err)
                 c->wpoll = 0;
@@ -401,7 +2768,7 @@ conn_mkevents (void)
             else
                 c->wpoll = n++;
         }
-        if (c->server)
+        if (c->server || uring_active ())
             c->npoll = 0;
         else
             c->npoll = n++;
@@ -409,13 +2776,28 @@ conn_mkevents (void)
 
     e = xmalloc (n * sizeof (*e));
     memset (e, 0, n * sizeof (*e));
-    if (cevents)
-        e[0] = cevents[0];
+    if (serverconf) {
+        e[0].fd = serverconf->udp_socket;	/* Datagrams for all conns */
+        e[0].events = POLLIN;
+    }
     else
         e[0].fd = -1;
     e[1].fd = 2;			/* Do catch errors on stderr */
+#if HAVE_IO_URING
+    if (uring_active ()) {
+        e[2].fd = uring.fd;		/* Completions to reap */
+        e[2].events = POLLIN;
+    }
+#endif /* HAVE_IO_URING */
 
     for (c = conn_list; c; c = c->next) {
+#if HAVE_PIPELINE
+        if (c->sio) {
+            e[c->rpoll].fd = c->sio->in.cfd;
+            e[c->rpoll].events = POLLIN;
+        }
+        else
+#endif /* HAVE_PIPELINE */
         if (c->rpoll) {
             e[c->rpoll].fd = c->rfd;
             if (!c->xoff)
@@ -423,11 +2805,11 @@ conn_mkevents (void)
         }
         if (c->wpoll) {
             e[c->wpoll].fd = c->wfd;
-            if (c->outq)
+            if (c->olen)
                 e[c->wpoll].events |= POLLOUT;
         }
         if (c->npoll) {
-            e[c->npoll].fd = c->nfd;
+            e[c->npoll].fd = conn_netfd (c);
             e[c->npoll].events |= POLLIN;
         }
     }
@@ -454,28 +2836,276 @@ conn_mkevents (void)
     evwriters = w;
 }
 
-long
-need_timer_in (const struct timespec *last, long timer)
+
+/* Receive whatever datagrams are waiting on a client connection's socket. */
+#if HAVE_UDP_GSO
+static void
+conn_recv_gro (conn_t *c)
 {
-    long to;
-    struct timespec ts;
+    struct mmsghdr msgs[GRO_BATCH];
+    struct iovec iov[GRO_BATCH];
+    union {
+        char buf[CMSG_SPACE (sizeof (int))];
+        struct cmsghdr align;
+    } ctl[GRO_BATCH];
+    packet_t pkt;
+    int i, n;
+
+    for (i = 0; i < GRO_BATCH; i++) {
+        iov[i].iov_base = grobufs + i * GRO_BUFSIZE;
+        iov[i].iov_len = GRO_BUFSIZE;
+        memset (&msgs[i], 0, sizeof (msgs[i]));
+        msgs[i].msg_hdr.msg_iov = &iov[i];
+        msgs[i].msg_hdr.msg_iovlen = 1;
+        msgs[i].msg_hdr.msg_control = ctl[i].buf;
+        msgs[i].msg_hdr.msg_controllen = sizeof (ctl[i].buf);
+    }
+    n = recvmmsg (c->nfd, msgs, GRO_BATCH, MSG_DONTWAIT, NULL);
+    if (n < 0 && errno != EAGAIN)
+        perror ("recv");
+
+    for (i = 0; i < n && !c->delete_me; i++) {
+        const char *buf = iov[i].iov_base;
+        int len = msgs[i].msg_len;
+        int seg = len, off;
+        struct cmsghdr *cm;
+
+        for (cm = CMSG_FIRSTHDR (&msgs[i].msg_hdr); cm;
+             cm = CMSG_NXTHDR (&msgs[i].msg_hdr, cm))
+            if (cm->cmsg_level == SOL_UDP && cm->cmsg_type == UDP_GRO)
+                memcpy (&seg, CMSG_DATA (cm), sizeof (seg));
+        if (seg <= 0)
+            seg = len;
+
+        /* The segments need not be aligned for packet_t; copy each out. */
+        for (off = 0; off < len && !c->delete_me; off += seg) {
+            int plen = len - off < seg ? len - off : seg;
+            if (plen > (int) sizeof (pkt))
+                plen = sizeof (pkt);	/* truncated, as recv would */
+            memcpy (&pkt, buf + off, plen);
+            if (opt_debug)
+                print_pkt (&pkt, "recv", plen);
+            rel_recvpkt (c->rel, &pkt, plen);
+            memset (&pkt, 0xc9, plen); /* for debugging */
+        }
+    }
+}
+#endif /* HAVE_UDP_GSO */
 
-    clock_gettime (CLOCK_MONOTONIC, &ts);
-    to = ts.tv_sec - last->tv_sec;
-    if (to > timer / 1000)
-        return 0;
-    to = to * 1000 + (ts.tv_nsec - last->tv_nsec) / 1000000;
-    if (to >= timer)
-        return 0;
-    return timer - to;
+static void
+conn_recv (conn_t *c)
+{
+#if HAVE_UDP_GSO
+    if (grobufs) {
+        conn_recv_gro (c);
+        return;
+    }
+#endif /* HAVE_UDP_GSO */
+#if HAVE_MMSG
+    static __thread packet_t pkts[RECV_BATCH];
+    packet_t *slots[RECV_BATCH];
+    struct mmsghdr msgs[RECV_BATCH];
+    struct iovec iov[RECV_BATCH];
+    int i, n;
+
+    /* Receive straight into the protocol's slots where it offers them. */
+    for (i = 0; i < RECV_BATCH; i++) {
+        if (!(slots[i] = rel_rxslot (c->rel, i)))
+            slots[i] = &pkts[i];
+        iov[i].iov_base = slots[i];
+        iov[i].iov_len = sizeof (*slots[i]);
+        memset (&msgs[i], 0, sizeof (msgs[i]));
+        msgs[i].msg_hdr.msg_iov = &iov[i];
+        msgs[i].msg_hdr.msg_iovlen = 1;
+    }
+    n = recvmmsg (c->nfd, msgs, RECV_BATCH, MSG_DONTWAIT, NULL);
+    if (n >= 0 || errno != ENOSYS) {
+        if (n < 0 && errno != EAGAIN)
+            perror ("recv");
+        for (i = 0; i < n && !c->delete_me; i++) {
+            int len = msgs[i].msg_len;
+            if (opt_debug)
+                print_pkt (slots[i], "recv", len);
+            rel_recvpkt (c->rel, slots[i], len);
+            if (slots[i] == &pkts[i])
+                memset (&pkts[i], 0xc9, len); /* for debugging */
+        }
+        return;
+    }
+#endif /* HAVE_MMSG */
+    packet_t pkt, *slot = rel_rxslot (c->rel, 0);
+    int len = debug_recv (c->nfd, slot ? slot : &pkt, sizeof (pkt), 0, NULL);
+    if (len < 0) {
+        if (errno != EAGAIN)
+            perror ("recv");
+    }
+    else {
+        rel_recvpkt (c->rel, slot ? slot : &pkt, len);
+        if (!slot)
+            memset (&pkt, 0xc9, len); /* for debugging */
+    }
 }
 
-void
-conn_poll (const struct config_common *cc)
+/* Find the server connection for a peer address. */
+static conn_t *
+conn_lookup (const struct sockaddr_storage *ss)
+{
+    size_t i;
+    unsigned int h;
+    conn_t *c;
+
+    if (!peertab_used)
+        return NULL;
+    h = addrhash (ss);
+    for (i = peertab_slot (h); (c = peertab[i]); i = (i + 1) & (peertab_size - 1))
+        if (c->hash == h && addreq (&c->peer, ss))
+            return c;
+    return NULL;
+}
+
+/* Server mode: one datagram arrived on the shared UDP socket.  Hand it
+ * to the peer's connection, creating one for a new peer. */
+static void
+server_pkt (packet_t *pkt, int len, const struct sockaddr_storage *from,
+            const struct config_common *cc)
+{
+    conn_t *c = conn_lookup (from);
+    rel_t *r;
+
+    if (c) {
+        if (c->delete_me)
+            return;
+        r = c->rel;
+    }
+    else if (!(r = rel_create (NULL, from, cc)))
+        return;
+    rel_recvpkt (r, pkt, len);
+    memset (pkt, 0xc9, len); /* for debugging */
+}
+
+static void
+server_recv (const struct config_common *cc)
+{
+    int s = serverconf->udp_socket;
+#if HAVE_MMSG
+    static __thread packet_t pkts[RECV_BATCH];
+    static __thread struct sockaddr_storage from[RECV_BATCH];
+    struct mmsghdr msgs[RECV_BATCH];
+    struct iovec iov[RECV_BATCH];
+    int i, n;
+
+    for (i = 0; i < RECV_BATCH; i++) {
+        iov[i].iov_base = &pkts[i];
+        iov[i].iov_len = sizeof (pkts[i]);
+        memset (&msgs[i], 0, sizeof (msgs[i]));
+        msgs[i].msg_hdr.msg_iov = &iov[i];
+        msgs[i].msg_hdr.msg_iovlen = 1;
+        msgs[i].msg_hdr.msg_name = &from[i];
+        msgs[i].msg_hdr.msg_namelen = sizeof (from[i]);
+    }
+    n = recvmmsg (s, msgs, RECV_BATCH, MSG_DONTWAIT, NULL);
+    if (n >= 0 || errno != ENOSYS) {
+        if (n < 0 && errno != EAGAIN && errno != ECONNREFUSED)
+            perror ("recvfrom");
+        for (i = 0; i < n; i++) {
+            if (opt_debug)
+                print_pkt (&pkts[i], "recv", msgs[i].msg_len);
+            server_pkt (&pkts[i], msgs[i].msg_len, &from[i], cc);
+        }
+        return;
+    }
+#endif /* HAVE_MMSG */
+    packet_t pkt;
+    struct sockaddr_storage ss;
+    int len = debug_recv (s, &pkt, sizeof (pkt), 0, &ss);
+    if (len < 0) {
+        if (errno != EAGAIN && errno != ECONNREFUSED)
+            perror ("recvfrom");
+    }
+    else
+        server_pkt (&pkt, len, &ss, cc);
+}
+
+/* Handle readiness of one descriptor belonging to connection c. */
+static void
+conn_dispatch (conn_t *c, int fd, int revents,
+               const struct config_common *cc)
+{
+#if HAVE_PIPELINE
+    if (c->sio && fd == c->sio->in.cfd) {
+        if (revents & POLLIN)
+            sio_ready (c);
+        return;
+    }
+    if (npipe && !c->server && fd == npipe->rx.cfd) {
+        if ((revents & POLLIN) && !c->delete_me)
+            netpipe_recv (c, cc);
+        return;
+    }
+#endif /* HAVE_PIPELINE */
+    if ((revents & (POLLIN|POLLERR|POLLHUP)) && !c->delete_me) {
+        if (fd == c->rfd) {
+            c->xoff = 1;
+            conn_rwant (c, 0);
+            conn_ready (c, READY_INPUT);
+        }
+        else if (fd == c->nfd && (revents & (POLLERR|POLLHUP)))
+            conn_peer_dead (c, cc);
+        else if (fd == c->nfd && !c->server)
+            conn_recv (c);
+    }
+    if ((revents & (POLLOUT|POLLHUP|POLLERR)) && fd == c->wfd)
+        conn_drain (c);
+}
+
+#if HAVE_EPOLL
+static void
+conn_poll_epoll (const struct config_common *cc)
+{
+    struct epoll_event evs[64];
+    struct evsrc *e, *ne;
+    int to = conn_timer_wait ();
+    int i, n;
+
+    for (e = evalways; e; e = e->anext)
+        if (e->events)
+            to = 0;
+
+    n = epoll_wait (epfd, evs, sizeof (evs) / sizeof (evs[0]), to);
+    for (i = 0; i < n; i++) {
+        e = evs[i].data.ptr;
+        /* If stderr has an error, the tester has probably died, so exit
+         * immediately. */
+        if (e == &stderr_src) {
+            if (evs[i].events & (POLLHUP|POLLERR))
+                exit (1);
+            continue;
+        }
+        if (e == &server_src) {
+            server_recv (cc);
+            continue;
+        }
+        if (!e->c)
+            continue;		/* uring_src; reaped in conn_poll */
+        conn_dispatch (e->c, e->fd, evs[i].events, cc);
+        if (evs[i].events & (POLLHUP|POLLERR))
+            ev_del (e);
+    }
+
+    for (e = evalways; e; e = ne) {
+        ne = e->anext;
+        if (e->events && e->c)
+            conn_dispatch (e->c, e->fd, e->events, cc);
+    }
+}
+#endif /* HAVE_EPOLL */
+
+static void
+conn_poll_poll (const struct config_common *cc)
 {
     int i;
-    conn_t *c, *nc;
-    static int last_cg;
+    conn_t *c;
+    static __thread int last_cg;
 
     if (last_cg != cevents_generation) {
         conn_mkevents ();
@@ -483,48 +3113,17 @@ conn_poll (const struct config_common *cc)
     }
 
     if (cevents[0].fd >= 0)
-        poll (cevents, ncevents, need_timer_in (&last_timeout, cc->timer));
+        poll (cevents, ncevents, conn_timer_wait ());
     else
-        poll (cevents+1, ncevents-1, need_timer_in (&last_timeout, cc->timer));
+        poll (cevents+1, ncevents-1, conn_timer_wait ());
+
+    if (cevents[0].revents & POLLIN)
+        server_recv (cc);
+    cevents[0].revents = 0;
 
     for (i = 1; i < ncevents; i++) {
-        if (cevents[i].revents & (POLLIN|POLLERR|POLLHUP)) {
-            if ((c = evreaders[i]) && !c->delete_me) {
-                if (cevents[i].fd == c->rfd) {
-                    c->xoff = 1;
-                    cevents[i].events &= ~POLLIN;
-                    rel_read (c->rel);
-                }
-                else if (cevents[i].fd == c->nfd
-                         && (cevents[i].revents & (POLLERR|POLLHUP))) {
-                    char addr[NI_MAXHOST] = "unknown";
-                    char port[NI_MAXSERV] = "unknown";
-                    getnameinfo ((const struct sockaddr *) &c->peer, sizeof (c->peer),
-                    addr, sizeof (addr), port, sizeof (port),
-                    NI_DGRAM | NI_NUMERICHOST|NI_NUMERICSERV);
-                    fprintf (stderr, "[received ICMP port unreachable;"
-                    " assuming peer at %s:%s is dead]\n", addr, port);
-                    if (cc->single_connection)
-                    exit (1);
-                    rel_destroy (c->rel);
-                }
-                else if (cevents[i].fd == c->nfd && !c->server) {
-                    packet_t pkt;
-                    int len = debug_recv (c->nfd, &pkt, sizeof (pkt), 0, NULL);
-                    if (len < 0) {
-                        if (errno != EAGAIN)
-                            perror ("recv");
-                    }
-                    else {
-                        rel_recvpkt (c->rel, &pkt, len);
-                        memset (&pkt, 0xc9, len); /* for debugging */
-                    }
-                }
-            }
-        }
-        if ((cevents[i].revents & (POLLOUT|POLLHUP|POLLERR))
-                && evwriters[i])
-            conn_drain (evwriters[i]);
+        if ((c = evreaders[i] ? evreaders[i] : evwriters[i]))
+            conn_dispatch (c, cevents[i].fd, cevents[i].revents, cc);
         if (cevents[i].revents & (POLLHUP|POLLERR)) {
 #if 0
             fprintf (stderr, "%5d Error on fd %d (0x%x)\n",
@@ -538,16 +3137,39 @@ conn_poll (const struct config_common *cc)
         }
         cevents[i].revents = 0;
     }
+}
 
-    if (need_timer_in (&last_timeout, cc->timer) == 0) {
-        rel_timer ();
-        clock_gettime (CLOCK_MONOTONIC, &last_timeout);
-    }
+void
+conn_poll (const struct config_common *cc)
+{
+    conn_t *c, **cp;
 
-    for (c = conn_list; c; c = nc) {
-        nc = c->next;
-        if (c->delete_me && (c->write_err || !c->outq))
-            conn_free (c);
+    conn_flush ();
+
+#if HAVE_EPOLL
+    if (epfd >= 0)
+        conn_poll_epoll (cc);
+    else
+#endif /* HAVE_EPOLL */
+        conn_poll_poll (cc);
+    clock_update ();
+
+#if HAVE_IO_URING
+    if (uring_active ())
+        uring_reap (cc);
+#endif /* HAVE_IO_URING */
+
+    conn_run_timers ();
+    conn_run_ready ();
+
+    conn_flush ();
+    for (cp = &dead_list; (c = *cp);) {
+        if (c->write_err || !conn_opending (c)) {
+            *cp = c->dnext;
+            conn_free (c, cc);
+        }
+        else
+            cp = &c->dnext;
     }
 }
 
@@ -741,6 +3363,11 @@ listen_on (int dgram, struct sockaddr_storage *ss)
     }
     if (!dgram)
         setsockopt (s, SOL_SOCKET, SO_REUSEADDR, (char *) &n, sizeof (n));
+#ifdef SO_REUSEPORT
+    else if (reuse_port
+             && setsockopt (s, SOL_SOCKET, SO_REUSEPORT, &n, sizeof (n)) < 0)
+        perror ("SO_REUSEPORT");
+#endif /* SO_REUSEPORT */
     if (bind (s, (const struct sockaddr *) ss, addrsize (ss)) < 0) {
         perror ("bind");
         close (s);
@@ -814,12 +3441,117 @@ struct sockaddr_storage *from)
     return n;
 }
 
+#if HAVE_IO_URING
+static int use_uring;
+#endif /* HAVE_IO_URING */
+
+/* Set up the calling thread's event loop. */
+static void
+loop_init (void)
+{
+#if HAVE_EPOLL
+    if (!opt_poll && (epfd = epoll_create1 (EPOLL_CLOEXEC)) >= 0) {
+        ev_add (&stderr_src, NULL, 2, 0);     /* Do catch errors on stderr */
+        if (serverconf)
+            ev_add (&server_src, NULL, serverconf->udp_socket, POLLIN);
+    }
+#endif /* HAVE_EPOLL */
+#if HAVE_IO_URING
+    /* The ring only carries client connections' traffic. */
+    if (use_uring && !serverconf && uring_init () == 0 && epfd >= 0)
+        ev_add (&uring_src, NULL, uring.fd, POLLIN);
+#endif /* HAVE_IO_URING */
+}
+
+struct worker {
+    struct config_server conf;
+    int cpu;			/* CPU to pin to, or -1 */
+    pthread_t tid;
+};
+
+static void *
+server_worker (void *arg)
+{
+    struct worker *w = arg;
+
+#ifdef __linux__
+    if (w->cpu >= 0) {
+        cpu_set_t set;
+        CPU_ZERO (&set);
+        CPU_SET (w->cpu, &set);
+        errno = pthread_setaffinity_np (pthread_self (), sizeof (set), &set);
+        if (errno)
+            perror ("pthread_setaffinity_np");
+    }
+#endif /* __linux__ */
+
+    serverconf = &w->conf;
+    loop_init ();
+    if (epfd < 0)
+        conn_mkevents ();
+    for (;;)
+        conn_poll (&serverconf->c);
+    return NULL;
+}
+
+/* Server mode: receive all UDP traffic on local and relay each peer's
+ * stream to its own TCP connection to remote.  With nthreads > 1, each
+ * worker thread binds its own socket to the same port (SO_REUSEPORT),
+ * so the kernel shards peers across workers by their address hash, and
+ * runs its own event loop and connection lists. */
+static int
+server_main (const struct config_common *cc, char *local, char *remote,
+             int nthreads, int pin)
+{
+    struct sockaddr_storage sl, dest;
+    struct worker *w;
+    long ncpus = sysconf (_SC_NPROCESSORS_ONLN);
+    int i;
+
+    if (get_address (&dest, 0, 0, AF_UNSPEC, remote) < 0
+            || get_address (&sl, 1, 1, AF_INET, local) < 0)
+        exit (1);
+
+    reuse_port = nthreads > 1;
+    w = xmalloc (nthreads * sizeof (*w));
+    memset (w, 0, nthreads * sizeof (*w));
+    for (i = 0; i < nthreads; i++) {
+        w[i].conf.c = *cc;
+        w[i].conf.c.single_connection = 0;
+        w[i].conf.dest = dest;
+        w[i].cpu = pin && ncpus > 0 ? i % ncpus : -1;
+        /* The first bind resolves port 0, so all workers share it. */
+        if ((w[i].conf.udp_socket = listen_on (1, &sl)) < 0)
+            exit (1);
+        make_async (w[i].conf.udp_socket);
+    }
+
+    for (i = 1; i < nthreads; i++)
+        if ((errno = pthread_create (&w[i].tid, NULL, server_worker, &w[i]))) {
+            perror ("pthread_create");
+            exit (1);
+        }
+    server_worker (&w[0]);
+    return 0;
+}
+
 static void
 usage (void)
 {
     fprintf (stderr,
                 "usage: %s udp-port [host:]udp-port\n"
-                , progname);
+                "       %s -s [-T threads [-A]] udp-port [host:]tcp-port\n"
+                "  -R file resumes an interrupted file transfer; both ends\n"
+                "  need it, and the output must be a file opened without\n"
+                "  truncation (1<>file)\n"
+                "  -C compresses the data sent, if the peer can take it\n"
+                "  -p receives and sends datagrams on threads of their own,\n"
+                "  and -I reads input and writes output on another\n"
+                "  -B bytes[k|m|g] caps the memory output buffers may grow\n"
+                "  into, over all connections (default 64m)\n"
+                "  -W advertises the receive window in ACKs (10 bytes\n"
+                "  instead of 8), which only this program understands\n"
+                , progname, progname);
     exit (1);
 }
 
@@ -829,6 +3561,20 @@ main (int argc, char **argv)
     struct option o[] = {
         { "debug", no_argument, NULL, 'd' },
         { "window", required_argument, NULL, 'w' },
+        { "poll", no_argument, NULL, 'P' },
+        { "uring", no_argument, NULL, 'U' },
+        { "gso", no_argument, NULL, 'G' },
+        { "server", no_argument, NULL, 's' },
+        { "threads", required_argument, NULL, 'T' },
+        { "pin", no_argument, NULL, 'A' },
+        { "splice", no_argument, NULL, 'z' },
+        { "mmap-output", no_argument, NULL, 'm' },
+        { "resume", required_argument, NULL, 'R' },
+        { "compress", no_argument, NULL, 'C' },
+        { "pipeline", no_argument, NULL, 'p' },
+        { "stdio-thread", no_argument, NULL, 'I' },
+        { "budget", required_argument, NULL, 'B' },
+        { "advertise-window", no_argument, NULL, 'W' },
         { NULL, 0, NULL, 0 }
     };
     int opt;
@@ -836,6 +3582,10 @@ main (int argc, char **argv)
     char *remote = NULL;
     struct config_common c;
     struct sigaction sa;
+    int opt_uring = 0;
+    int opt_server = 0;
+    int opt_pin = 0;
+    int nthreads = 1;
 
     /* Ignore SIGPIPE, since we may get a lot of these */
     memset (&sa, 0, sizeof (sa));
@@ -852,7 +3602,7 @@ main (int argc, char **argv)
     else
         progname = argv[0];
 
-    while ((opt = getopt_long (argc, argv, "cdust:w:l", o, NULL)) != -1)
+    while ((opt = getopt_long (argc, argv, "cdust:w:lPUGT:AzmR:CpIB:W", o, NULL)) != -1)
         switch (opt) {
         case 'd':
             opt_debug = 1;
@@ -876,19 +3626,115 @@ main (int argc, char **argv)
         case 't':
             c.timeout = atoi (optarg);
             break;
+        case 'P':
+            opt_poll = 1;
+            break;
+        case 'U':
+            opt_uring = 1;
+            break;
+        case 's':
+            opt_server = 1;
+            break;
+        case 'T':
+            nthreads = atoi (optarg);
+            break;
+        case 'A':
+            opt_pin = 1;
+            break;
+        case 'm':
+            opt_mmap_out = 1;
+            break;
+        case 'R':
+            c.checkpoint = optarg;
+            break;
+        case 'C':
+            c.compress = 1;
+            break;
+        case 'W':
+            c.advertise = 1;
+            break;
+        case 'B':
+            {
+                char *end;
+                int shift = 0;
+                errno = 0;
+                obuf_budget = strtoul (optarg, &end, 10);
+                if (end == optarg || errno || *optarg == '-')
+                    usage ();
+                if (*end == 'k' || *end == 'K')
+                    shift = 10;
+                else if (*end == 'm' || *end == 'M')
+                    shift = 20;
+                else if (*end == 'g' || *end == 'G')
+                    shift = 30;
+                if (end[shift ? 1 : 0])
+                    usage ();
+                obuf_budget <<= shift;
+            }
+            break;
+        case 'z':
+#if HAVE_VMSPLICE
+            opt_splice = 1;
+#else /* !HAVE_VMSPLICE */
+            fprintf (stderr, "%s: vmsplice not supported, ignoring -z\n",
+                     progname);
+#endif /* !HAVE_VMSPLICE */
+            break;
+        case 'p':
+        case 'I':
+#if HAVE_PIPELINE
+            if (opt == 'p')
+                opt_pipeline = 1;
+            else
+                opt_stdio = 1;
+#else /* !HAVE_PIPELINE */
+            fprintf (stderr, "%s: threads not supported, ignoring -%c\n",
+                     progname, opt);
+#endif /* !HAVE_PIPELINE */
+            break;
+        case 'G':
+#if HAVE_UDP_GSO
+            opt_gso = 1;
+#else /* !HAVE_UDP_GSO */
+            fprintf (stderr, "%s: UDP GSO not supported, ignoring -G\n",
+                     progname);
+#endif /* !HAVE_UDP_GSO */
+            break;
         default:
             usage ();
             break;
         }
 
-    if (optind + 2 != argc || c.window < 1 || c.timeout < 10) {
+    if (optind + 2 != argc || c.window < 1 || c.timeout < 10
+            || nthreads < 1) {
         usage ();
     }
 
-    c.timer = c.timeout / 5;
+    if (log_in >= 0 || log_out >= 0)
+        log_start ();
+
     local = argv[optind];
     remote = argv[optind+1];
 
+    if (opt_uring)
+#if HAVE_IO_URING
+        use_uring = 1;
+#else /* !HAVE_IO_URING */
+        fprintf (stderr, "%s: io_uring not supported, ignoring -U\n",
+                 progname);
+#endif /* !HAVE_IO_URING */
+
+    /* -p and -I serve the one connection of client mode; -R seeks in
+     * the input, which -I reads ahead. */
+    if (opt_server && (c.checkpoint || opt_pipeline || opt_stdio))
+        usage ();
+    if ((opt_stdio && c.checkpoint) || (opt_pipeline && opt_uring))
+        usage ();
+    if (opt_server)
+        return server_main (&c, local, remote, nthreads, opt_pin);
+
+    loop_init ();
+
     struct sockaddr_storage sl, sr;
     conn_t *cn = conn_alloc ();
     c.single_connection = 1;
@@ -904,14 +3750,46 @@ main (int argc, char **argv)
     }
     cn->server = 0;
     cn->peer = sr;
+#if HAVE_UDP_GSO
+    if (opt_gso && !uring_active () && !opt_pipeline) {
+        int on = 1;
+        if (setsockopt (cn->nfd, SOL_UDP, UDP_GRO, &on, sizeof (on)) == 0)
+            grobufs = xmalloc (GRO_BATCH * GRO_BUFSIZE);
+        else
+            perror ("UDP_GRO");
+    }
+#endif /* HAVE_UDP_GSO */
     make_async (cn->rfd);
     make_async (cn->wfd);
-    make_async (cn->nfd);
+    if (opt_stdio) {
+#if HAVE_PIPELINE
+        sio_start (cn);
+#endif /* HAVE_PIPELINE */
+    }
+    else {
+#if HAVE_VMSPLICE
+        if (opt_splice)
+            conn_pipe_init (cn);
+#endif /* HAVE_VMSPLICE */
+        conn_map_input (cn);
+        if (opt_mmap_out)
+            conn_map_output (cn);
+    }
+    /* With io_uring, receives stay posted on the socket; leaving it
+     * blocking lets the kernel park them instead of failing with EAGAIN. */
+    if (!uring_active ())
+        make_async (cn->nfd);
+#if HAVE_PIPELINE
+    if (opt_pipeline)
+        netpipe_start (cn->nfd);
+#endif /* HAVE_PIPELINE */
     cn->rel = rel_create (cn, NULL, &c);
+    conn_register (cn);
 
-    conn_mkevents ();
+    if (epfd < 0)
+        conn_mkevents ();
     while (conn_list)
         conn_poll (&c);
 
-    return 0;
+    return __atomic_load_n (&conn_failed, __ATOMIC_RELAXED);
 }
@@ -7,6 +7,7 @@
 
 #include <stdint.h>
 #include <sys/types.h>
+#include <sys/uio.h>
 
 /* -----------------------------------------------------------------------
 
@@ -30,6 +31,10 @@
             packets, and 12 + payload-size for data packets (since 12
             bytes are used for the header).
 
+            With -W, Ack packets are 10 bytes instead: after the ackno
+            comes a 16-bit window, the number of packets from ackno on
+            the receiver can take.
+
 	    An end-of-file condition is transmitted to the other side
             of a connection by a data packet containing 0 bytes of
             payload, and hence a len of 12.
@@ -74,6 +79,16 @@ struct ack_packet {
     uint32_t ackno;
 };
 
+/* ... or 10, with the sender's receive window after the ackno.  Packed,
+ * so that its size is the size on the wire; read and write window with
+ * memcpy at its offset in a packet_t. */
+struct ack_wnd_packet {
+    uint16_t cksum;
+    uint16_t len;
+    uint32_t ackno;
+    uint16_t window;
+} __attribute__ ((packed));
+
 struct packet {
     uint16_t cksum;
     uint16_t len;
@@ -167,20 +182,23 @@ typedef struct packet packet_t;
      point you can send out more Acks to get more data from the remote
      side.
 
-   * The function rel_timer is called periodically, currently at a
-     rate 1/5 of the retransmission interval.  You can use this timer
-     to inspect packets and retransmit packets that have not been
-     acknowledged.  Do not retransmit every packet every time the
-     timer is fired!  You must keep track of which packets need to be
-     retransmitted when.
+   * The function rel_timer is only called when you ask for it: call
+     conn_timer (c, ms) and the library calls rel_timer for that
+     connection no later than ms milliseconds from then.  Asking
+     again before it fires only moves the deadline earlier.  Use it
+     to retransmit packets that have not been acknowledged in time,
+     and ask again from rel_timer while anything is still pending.
+     A connection with nothing pending gets no calls at all.
 
 */
 
 struct config_common {
     int window;			/* # of unacknowledged packets in flight */
-    int timer;			/* How often rel_timer called in milliseconds */
     int timeout;			/* Retransmission timeout in milliseconds */
     int single_connection;        /* Exit after first connection failure */
+    const char *checkpoint;	/* Resume from/record progress here (-R) */
+    int compress;			/* Compress data if the peer can take it (-C) */
+    int advertise;		/* Put our receive window in ACKs (-W) */
 };
 
 typedef struct reliable_state rel_t;
@@ -231,11 +249,18 @@ conn_t *conn_create (rel_t *, const struct sockaddr_storage *);
 /**
  * Call this function to send a UDP packet to the other side.
  *
+ * The packet is copied, and usually only queued: queued packets go out
+ * in batches (sendmmsg, io_uring, or the -p send thread) once the
+ * event loop gets back to them.  Errors on those sends are not
+ * reported here; they show up later, in the -d log, and as a dead
+ * peer (conn_peer_dead) if the kernel reports port unreachable.
+ *
  * @param   pkt      Pointer to packet to be sent
  *
  * @param   len      Length of the packet
  *
- * @return  number of bytes sent if successfull, -1 otherwise
+ * @return  len if the packet was queued or sent, -1 if sending it
+ *          failed right away
  */
 int conn_sendpkt (conn_t *c, const packet_t *pkt, size_t len);
 
@@ -244,6 +269,10 @@ int conn_sendpkt (conn_t *c, const packet_t *pkt, size_t len);
  * to return 0 if you write less than this many bytes. */
 size_t conn_bufspace (conn_t *c);
 
+/* What conn_bufspace would say, without making room for more output
+ * first: for reporting, such as in an advertised window. */
+size_t conn_bufroom (conn_t *c);
+
 /* Call this function to produce output from the UDP packets you have
  * received.  If you call it with len == 0, then it will send an EOF
  * to the other side.  Returns number of bytes written (>= 0) on
@@ -262,10 +291,24 @@ size_t conn_bufspace (conn_t *c);
  **/
 int conn_output (conn_t *c, const void *buf, size_t len);
 
+/* Like conn_output, but gathers the data from iovcnt buffers, so that
+ * many packets' payloads can be handed over (and usually written out
+ * with a single writev) at once.  Returns the total number of bytes
+ * accepted, which is all of them if they fit in conn_bufspace, or -1
+ * on error.  Use conn_output with len == 0 to send an EOF.
+ *
+ * @param   iov      Array of buffers to be written to output, in order
+ *
+ * @param   iovcnt   Number of buffers (at most IOV_MAX)
+ **/
+int conn_outputv (conn_t *c, const struct iovec *iov, int iovcnt);
+
 /* Get some input from the reliable side.  You must must then put the
  * data into UDP sockets which you send out with conn_sendpkt.  This
  * function returns the number of bytes received, 0 if there is no
- * data currently available, and -1 on EOF or error.
+ * data currently available, and -1 on EOF or error.  Input is read
+ * ahead into a 64 KB staging buffer, so most calls don't make a
+ * system call; -1 is returned only once that buffer is empty.
  *
  * @param   buf      Pointer to where data obtained from input should be put
  *
@@ -273,9 +316,74 @@ int conn_output (conn_t *c, const void *buf, size_t len);
  */
 int conn_input (conn_t *c, void *buf, size_t len);
 
+/* If the input is a regular file, it is memory-mapped, and this
+ * returns the start of the mapping (NULL otherwise).  Input returned
+ * by conn_input is then taken from the mapping in order, so bytes
+ * once read can be looked up again instead of being kept around.
+ *
+ * @param   pos      If not NULL, set to the offset of the next byte
+ *                   conn_input will return
+ */
+const char *conn_input_map (conn_t *c, size_t *pos);
+
+/* Check whether conn_input has anything to return, without consuming
+ * it.  Returns the number of bytes that can be had without blocking
+ * (possibly fewer than are available), 0 if none (rel_read will be
+ * called when there are), or -1 on EOF or error. */
+int conn_input_avail (conn_t *c);
+
+/* Read input at an absolute offset, without affecting conn_input.
+ * Only possible for regular files; returns the number of bytes read,
+ * or -1 on error. */
+ssize_t conn_input_pread (conn_t *c, void *buf, size_t n, uint64_t off);
+
+/* Make conn_input continue at absolute offset off of the input,
+ * dropping anything read ahead.  Returns 0 on success, or -1 if the
+ * input can't seek (e.g., is a pipe), or is shorter than off. */
+int conn_input_seek (conn_t *c, uint64_t off);
+
+/* Truncate the output to off bytes and continue writing there.  Only
+ * possible when the output is a regular file at least off bytes long,
+ * with nothing queued; returns 0 on success, -1 otherwise. */
+int conn_output_rewind (conn_t *c, uint64_t off);
+
+/* Have rel_timer called for this connection within ms milliseconds
+ * (0: as soon as the library gets back to its event loop).  An
+ * earlier deadline already set is kept. */
+void conn_timer (conn_t *c, long ms);
+
+/* Tell the library the connection's round-trip time in milliseconds,
+ * which it uses to size the output buffering. */
+void conn_set_rtt (conn_t *c, long ms);
+
+/* Milliseconds on a monotonic clock, as of the current round of
+ * events: the library reads CLOCK_MONOTONIC once per round, so this
+ * costs no system call and is the same for everything handled in it.
+ * conn_timer deadlines are on this clock, too. */
+long clock_now_ms (void);
+
+/* Take the time from fn (in nanoseconds, never going back) instead of
+ * CLOCK_MONOTONIC, e.g. a virtual clock for simulations or benchmarks.
+ * NULL goes back to the real clock.  Call before the first conn_poll. */
+void clock_set_source (uint64_t (*fn) (void));
+
+/* Have rel_read (conn_defer_read) or rel_output (conn_defer_output)
+ * called for this connection once the events at hand have been
+ * handled, however many times it is asked for until then. */
+void conn_defer_read (conn_t *c);
+void conn_defer_output (conn_t *c);
+
+/* Datagrams are received up to this many at a time. */
+#define RECV_BATCH 32
+
 /* Deallocate a connection */
 void conn_destroy (conn_t *c);
 
+/* Give up on a connection after a protocol error: its output is no
+ * longer written, and the program exits nonzero once the connections
+ * are gone.  rel_destroy must still be called. */
+void conn_abort (conn_t *c);
+
 /* Functions you must provide (in reliable.c). */
 
 rel_t *rel_create (conn_t *, const struct sockaddr_storage *,
@@ -285,10 +393,17 @@ void rel_destroy (rel_t *);
 /* This function gets called on clients, when packets arrive: */
 void rel_recvpkt (rel_t *, packet_t *pkt, size_t len);
 
+/* Called on clients before each receive, to ask where the i-th datagram
+ * of the batch (0 <= i < RECV_BATCH) should be put.  A packet received
+ * into such a slot is passed to rel_recvpkt where it lies, so it can be
+ * kept without copying it; a slot that was kept must not be handed out
+ * again.  Return NULL to let the library use a buffer of its own. */
+packet_t *rel_rxslot (rel_t *, int i);
+
 /* Notification handlers */
 void rel_read (rel_t *);    /* Invoked when you can call conn_input */
 void rel_output (rel_t *);  /* Invoked when some output drained */
-void rel_timer (void); /* Invoked roughly each timer/5 milliseconds */
+void rel_timer (rel_t *);   /* Invoked when a conn_timer deadline is due */
 
 
 